@@ -1,10 +1,29 @@
-
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include "sikfck.h"
+#include "sikfckBatch.h"
+#include "sikfckCheckpoint.h"
 #include "sikfckCompiler.h"
 #include "sikfckLoopOptimizations.h"
+#include "sikfckParallel.h"
+#include "sikfckProfiler.h"
+#include "sikfckTiered.h"
+#include "sikfckTrace.h"
+
+static std::atomic<bool> checkpointRequested(false);
+
+static void RequestCheckpoint(int)
+{
+	checkpointRequested.store(true);
+}
 
 int main(int argc, char** argv) {
 
@@ -14,26 +33,288 @@ int main(int argc, char** argv) {
 	bool finalListing = true;
 	bool verboseOptimisation = true;
 
+	const char* sourceFile = nullptr;
+	const char* checkpointFile = nullptr;
+	const char* restoreFile = nullptr;
+	unsigned checkpointInterval = 0;
+	bool tiered = false;
+	bool profile = false;
+	const char* traceFile = nullptr;
+	bool parallel = false;
+	bool batch = false;
+	unsigned optimizationLevel = 2;
+	unsigned compileBudget = 0;
+
+	for (int i = 1; i < argc; i++)
+	{
+		if (std::strcmp(argv[i], "-checkpoint") == 0 && i + 1 < argc)
+		{
+			checkpointFile = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "-interval") == 0 && i + 1 < argc)
+		{
+			checkpointInterval = std::atoi(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "-restore") == 0 && i + 1 < argc)
+		{
+			restoreFile = argv[++i];
+		}
+		else if (std::strcmp(argv[i], "-tiered") == 0)
+		{
+			tiered = true;
+		}
+		else if (std::strcmp(argv[i], "-profile") == 0)
+		{
+			profile = true;
+		}
+		else if (std::strcmp(argv[i], "-parallel") == 0)
+		{
+			parallel = true;
+		}
+		else if (argv[i][0] == '-' && argv[i][1] == 'O' && argv[i][2] >= '0' && argv[i][2] <= '3' && argv[i][3] == 0)
+		{
+			optimizationLevel = argv[i][2] - '0';
+		}
+		else if (std::strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+		{
+			compileBudget = std::atoi(argv[++i]);
+		}
+		else if (std::strcmp(argv[i], "-batch") == 0)
+		{
+			batch = true;
+		}
+		else if (std::strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+		{
+			traceFile = argv[++i];
+		}
+		else if (sourceFile == nullptr)
+		{
+			sourceFile = argv[i];
+		}
+		else
+		{
+			sourceFile = nullptr;
+			break;
+		}
+	}
+
+	// a long job gets everything, tiering only where nothing else needs to follow the Cpu
+	if (optimizationLevel >= 3 && !batch && !parallel && !profile && traceFile == nullptr && checkpointFile == nullptr && restoreFile == nullptr)
+	{
+		tiered = true;
+	}
+
+	if (tiered && (checkpointFile != nullptr || restoreFile != nullptr))
+	{
+		// hot loops are patched while running, a checkpoint could not be matched to the program
+		printf("-tiered cannot be combined with checkpoints\n");
+		sourceFile = nullptr;
+	}
+
+	if (tiered && (profile || traceFile != nullptr))
+	{
+		// the tiered executor runs the program with its own monitor and memory
+		printf("-tiered cannot be combined with -profile or -trace\n");
+		sourceFile = nullptr;
+	}
+
+	if (parallel && (tiered || profile || traceFile != nullptr || checkpointFile != nullptr || restoreFile != nullptr))
+	{
+		// segments run on their own Cpu instances, which none of these can follow
+		printf("-parallel cannot be combined with -tiered, -profile, -trace or checkpoints\n");
+		sourceFile = nullptr;
+	}
+
+	if (batch && (tiered || parallel || profile || traceFile != nullptr || checkpointFile != nullptr || restoreFile != nullptr))
+	{
+		// every input runs on its own lane of the batch tape
+		printf("-batch cannot be combined with -tiered, -parallel, -profile, -trace or checkpoints\n");
+		sourceFile = nullptr;
+	}
 
-	if (argc!=2)
+	if (sourceFile == nullptr)
 	{
-		printf("Usage: sikfck sourcefile.bf\n");
+		printf("Usage: sikfck sourcefile.bf [-checkpoint file] [-interval seconds] [-restore file] [-tiered] [-profile] [-trace file] [-parallel] [-batch] [-O0..-O3] [-budget milliseconds]\n");
+		printf("  -checkpoint  file to write the program state to when a checkpoint is triggered\n");
+		printf("  -interval    write a checkpoint periodically, every given number of seconds\n");
+		printf("  -restore     resume from checkpoint, the same input must be supplied again\n");
+		printf("  -tiered      re-optimize loops that run often while the program is running\n");
+		printf("  -profile     sample cycles, instructions, branch and cache misses per instruction type\n");
+		printf("  -trace       write tape accesses to a binary trace file and print a summary of the tape use\n");
+		printf("  -parallel    run independent parts of the program that use separate cells on several threads\n");
+		printf("  -batch       run the program once for each line of input, several lines in lockstep\n");
+		printf("  -O0 .. -O3   optimization level: none, flat code, loops (default), all with shared loops and tiering\n");
+		printf("  -budget      stop optimizing loops after the given number of milliseconds, those that pay off most go first\n");
+#ifdef SIGUSR1
+		printf("A checkpoint can be triggered at any time by sending SIGUSR1.\n");
+#endif
 		return 1;
 	}
-	std::ifstream t(argv[1]);
+	std::ifstream t(sourceFile);
 	std::stringstream buffer;
 	buffer << t.rdbuf();
 
 	Compiler<int, int> compiler;
 	compiler.verboseOptimisation = verboseOptimisation;
+	compiler.optimizationLevel = optimizationLevel;
+	compiler.compileTimeBudget = compileBudget;
 	compiler.UseLoopOptimization<loopOpt::SetToZero<int, int>>();
 	compiler.UseLoopOptimization<loopOpt::LinearArithmetic<int, int>>();
+	compiler.UseLoopOptimization<loopOpt::ClearUntilZero<int, int>>();
+	compiler.UseLoopOptimization<loopOpt::MoveUntilZero<int, int>>();
+	compiler.UseLoopOptimization<loopOpt::RegisterPromotion<int, int>>();
 
 	auto program = compiler.Compile(buffer.str());
 	auto optimised = compiler.Optimize(program);
+	if (optimizationLevel >= 3 && !batch)
+	{
+		// shared subroutines are not run in lockstep, a batch keeps the loops inline
+		optimised = compiler.Deduplicate(optimised);
+	}
 	Cpu<int, int, int> core;
 	Memory<int, int> memory;
-	core.Run(optimised, memory);
+
+	if (restoreFile != nullptr)
+	{
+		std::ifstream in(restoreFile, std::ios::binary);
+		Checkpoint<int, int, int>::Load(in, optimised, core, memory);
+		// input consumed before the checkpoint was taken is replayed by the caller, skip it
+		for (size_t i = 0; i < core.GetInputPosition(); i++)
+		{
+			std::getchar();
+		}
+	}
+
+	std::mutex timerMutex;
+	std::condition_variable timerStop;
+	bool finished = false;
+	std::thread timer;
+
+	if (checkpointFile != nullptr)
+	{
+		core.suspendRequest = &checkpointRequested;
+#ifdef SIGUSR1
+		std::signal(SIGUSR1, RequestCheckpoint);
+#endif
+#ifdef SIGBREAK
+		std::signal(SIGBREAK, RequestCheckpoint);
+#endif
+		if (checkpointInterval > 0)
+		{
+			timer = std::thread([&]() {
+				std::unique_lock<std::mutex> lock(timerMutex);
+				while (!timerStop.wait_for(lock, std::chrono::seconds(checkpointInterval), [&]() { return finished; }))
+				{
+					RequestCheckpoint(0);
+				}
+			});
+		}
+	}
+
+	if (tiered)
+	{
+		Compiler<int, int> hotCompiler;
+		hotCompiler.UseLoopOptimization<loopOpt::SetToZero<int, int>>();
+		hotCompiler.UseLoopOptimization<loopOpt::LinearArithmetic<int, int>>();
+		hotCompiler.UseLoopOptimization<loopOpt::ClearUntilZero<int, int>>();
+		hotCompiler.UseLoopOptimization<loopOpt::MoveUntilZero<int, int>>();
+		hotCompiler.UseLoopOptimization<loopOpt::RegisterPromotion<int, int>>();
+		TieredExecutor<int, int, int> executor(hotCompiler, optimised);
+		executor.Run(core, memory);
+		optimised = executor.GetProgram();
+		if (verboseOptimisation)
+		{
+			std::cerr << "\nHot loops re-optimized: " << std::noshowpos << executor.GetPromotedLoopCount() << "\n";
+		}
+	}
+
+	if (parallel)
+	{
+		ParallelExecutor<int, int, int> executor(optimised);
+		executor.Run(core, memory);
+		if (verboseOptimisation)
+		{
+			std::cerr << "\nParallel batches: " << std::noshowpos << executor.GetBatches().size() << ", speculative segments run again: " << executor.GetReexecutedCount() << "\n";
+		}
+	}
+
+	if (batch)
+	{
+		std::vector<std::string> inputs;
+		std::string line;
+		while (std::getline(std::cin, line))
+		{
+			inputs.push_back(line + (std::cin.eof() ? "" : "\n"));
+		}
+		BatchCpu<int, int, int> batchCpu;
+		for (const std::string& output : batchCpu.Run(LinkedProgram<int, int>(optimised), inputs))
+		{
+			std::fwrite(output.data(), 1, output.size(), stdout);
+		}
+		if (verboseOptimisation)
+		{
+			std::cerr << "\nBatch inputs: " << std::noshowpos << inputs.size() << ", lanes split off: " << batchCpu.GetSplitLaneCount() << ", lockstep instructions: " << batchCpu.GetLockstepInstructionCount() << "\n";
+		}
+	}
+
+	LinkedProgram<int, int> linked(optimised);
+	Profiler profiler;
+	if (profile)
+	{
+		profiler.Start();
+	}
+	std::ofstream traceOut;
+	if (traceFile != nullptr)
+	{
+		traceOut.open(traceFile, std::ios::binary | std::ios::trunc);
+	}
+	TracingMemory<int, int> tracing(memory, traceFile != nullptr ? &traceOut : nullptr);
+	StandardIo io;
+	NullMonitor noMonitor;
+	auto run = [&]()
+	{
+		if (traceFile != nullptr)
+		{
+			return profile ? core.Run(linked, tracing, io, profiler) : core.Run(linked, tracing, io, noMonitor);
+		}
+		return profile ? core.Run(linked, memory, profiler) : core.Run(linked, memory);
+	};
+	while (!tiered && !parallel && !batch && run() == ExecutionResult::Suspended)
+	{
+		checkpointRequested.store(false);
+		std::fflush(stdout);
+		// write to a temporary file first so a crash while saving keeps the previous checkpoint
+		std::string temporaryFile = std::string(checkpointFile) + ".tmp";
+		{
+			std::ofstream out(temporaryFile, std::ios::binary | std::ios::trunc);
+			Checkpoint<int, int, int>::Save(out, optimised, core, memory);
+		}
+		std::remove(checkpointFile);
+		std::rename(temporaryFile.c_str(), checkpointFile);
+	}
+
+	if (profile)
+	{
+		profiler.Stop();
+		std::fflush(stdout);
+		profiler.Print(std::cerr);
+	}
+
+	if (traceFile != nullptr)
+	{
+		std::fflush(stdout);
+		tracing.Print(std::cerr);
+	}
+
+	if (timer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(timerMutex);
+			finished = true;
+		}
+		timerStop.notify_all();
+		timer.join();
+	}
 
 	if (finalListing)
 	{
@@ -41,4 +322,4 @@ int main(int argc, char** argv) {
 		std::cerr << optimised;
 	}
 	return 0;
-}
\ No newline at end of file
+}
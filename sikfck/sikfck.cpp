@@ -16,6 +16,16 @@ std::ostream& sikfck::operator<<(std::ostream& out, const InstructionType& i) {
 		case InstructionType::AddM: out << "ADDM"; break;
 		case InstructionType::SubM: out << "SUBM"; break;
 		case InstructionType::MulM: out << "MULM"; break;
+		case InstructionType::Block: out << "BLOCK"; break;
+		case InstructionType::Data: out << "DATA"; break;
+		case InstructionType::Clear: out << "CLEAR"; break;
+		case InstructionType::ClearScan: out << "CLEARZ"; break;
+		case InstructionType::MoveScan: out << "MOVEZ"; break;
+		case InstructionType::RegLoad: out << "REGLD"; break;
+		case InstructionType::RegSelect: out << "REGSEL"; break;
+		case InstructionType::RegStore: out << "REGST"; break;
+		case InstructionType::Call: out << "CALL"; break;
+		case InstructionType::Ret: out << "RET"; break;
 	}
 	return out;
 }
\ No newline at end of file
@@ -1,6 +1,14 @@
 #pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
+#include <stdexcept>
+#include <utility>
 #include <vector>
+#include "sikfckSimd.h"
 
 namespace sikfck {
 
@@ -17,11 +25,54 @@ namespace sikfck {
 		Out,
 		Jz,
 		Jnz,
-		Set
+		Set,
+		Block, // apply additions and sets to a window of cells, then move the pointer, see Compiler::TryFoldBlock
+		Clear, // clear a window of cells, then move the pointer, data words as for Block without deltas
+		ClearScan, // clear cells in steps of value until a zero cell is reached
+		MoveScan, // add current cell to target cells and clear it, step until a zero cell is reached
+		RegLoad, // load the cells at the data word offsets into the register file, see LoopOptimizations::RegisterPromotion
+		RegSelect, // make register value the current value, the pointer does not move
+		RegStore, // write the register file back to the cells at the data word offsets
+		Call, // push the index after the call on the return stack and jump, relative target as for Jz, see Compiler::Deduplicate
+		Ret, // continue at the index popped from the return stack, halts when the stack is empty
+		Data // operand of the preceding instruction, never executed
 	};
 
 	std::ostream& operator<<(std::ostream& out, const InstructionType& i);
 
+	// size of the Cpu return stack, Compiler::Deduplicate never nests calls deeper
+	const unsigned maxCallDepth = 32;
+
+	enum class ExecutionResult {
+		Halted, // program counter reached the end of the program
+		Suspended, // suspend was requested, calling Run again continues execution
+		Interrupted // the monitor stopped execution before the current instruction
+	};
+
+	// Run calls the monitor before executing each instruction, returning false interrupts execution.
+	// NullMonitor observes nothing and is optimized away completely.
+	class NullMonitor {
+	public:
+		template <typename TProgramCounter> bool Step(TProgramCounter, InstructionType) {
+			return true;
+		}
+	};
+
+	// Input and output of the process, used by Cpu::Run unless another I/O object is given.
+	// An I/O object reads a byte or EOF with Read and writes the low byte of a value with Write.
+	class StandardIo {
+	public:
+		int Read() {
+			return std::getchar();
+		}
+
+		void Write(int value) {
+			std::putchar(value);
+		}
+	};
+
+	template <typename TRegister, typename TProgramCounter, typename TPointer> class Checkpoint;
+
 	template <typename TRegister> class Instruction {
 	public:
 		InstructionType type;
@@ -157,7 +208,7 @@ namespace sikfck {
 				// list instruction
 				out << "\t" << program.itype[i] << " " << std::showpos << static_cast<int>(program.ivalue[i]);
 
-				if (program.itype[i] == InstructionType::Jz || program.itype[i] == InstructionType::Jnz)
+				if (program.itype[i] == InstructionType::Jz || program.itype[i] == InstructionType::Jnz || program.itype[i] == InstructionType::Call)
 				{
 					out << "; L_" << std::noshowpos << (absolutePos + program.ivalue[i]) << "\n";
 					out << "L_" << std::noshowpos << absolutePos << ":";
@@ -176,13 +227,140 @@ namespace sikfck {
 		}
 	};
 
+	// Execution ready form of a Program, produced once after optimization and consumed by Cpu::Run.
+	// Every instruction is a single 8 byte word holding the opcode and one operand, jumps hold absolute targets.
+	// Variable length instructions (Block, Clear, MoveScan, RegLoad, RegStore) keep their Data words as placeholders so indices
+	// stay the same as in the Program; their operand indexes constants, which holds the number of data words
+	// followed by the data words, so kernels can load them contiguously.
+	template <typename TRegister, typename TProgramCounter> class LinkedProgram {
+	public:
+		struct Word {
+			uint8_t type;
+			int32_t value;
+		};
+		static_assert(sizeof(Word) == 8, "linked instructions must be packed in 8 bytes");
+		static_assert(sizeof(TRegister) <= sizeof(int32_t) && sizeof(TProgramCounter) <= sizeof(int32_t), "operands and jump targets must fit the 32 bit operand of a word");
+
+		std::vector<Word> code;
+		std::vector<TRegister> constants;
+
+		LinkedProgram() {}
+
+		explicit LinkedProgram(const Program<TRegister, TProgramCounter>& program) {
+			code.resize(program.GetSize());
+			Link(program, 0, program.GetSize());
+		}
+
+		// (re)links the instructions in [begin, end), used after the program was patched in place
+		void Link(const Program<TRegister, TProgramCounter>& program, TProgramCounter begin, TProgramCounter end) {
+			for (TProgramCounter i = begin; i < end; ++i) {
+				InstructionType type = program.itype[i];
+				Word word;
+				word.type = static_cast<uint8_t>(type);
+				word.value = static_cast<int32_t>(program.ivalue[i]);
+				if (type == InstructionType::Jz || type == InstructionType::Jnz || type == InstructionType::Call) {
+					word.value = static_cast<int32_t>(i + program.ivalue[i]);
+				}
+				code[i] = word;
+			}
+			// constants are laid out again for the whole program, a relinked region leaves no stale entries behind
+			constants.clear();
+			for (TProgramCounter i = 0; i < GetSize(); ++i) {
+				switch (program.itype[i]) {
+				case InstructionType::Block:
+				case InstructionType::Clear:
+				case InstructionType::MoveScan:
+				case InstructionType::RegLoad:
+				case InstructionType::RegStore:
+					code[i].value = static_cast<int32_t>(constants.size());
+					constants.insert(constants.end(), program.ivalue.begin() + i, program.ivalue.begin() + i + program.ivalue[i] + 1);
+					i += program.ivalue[i];
+					break;
+				default:
+					break;
+				}
+			}
+		}
+
+		inline TProgramCounter GetSize() const {
+			return static_cast<TProgramCounter>(code.size());
+		}
+	};
+
 	template <typename TRegister, typename TPointer> class Memory {
+	public:
+		static const unsigned size = 65536;
+		typedef void(*Releaser)(TRegister* storage);
+
+	private:
+		TRegister* raw;
+		Releaser release;
+
+		static void Free(TRegister* storage) {
+			std::free(storage);
+		}
+
+		static TRegister* Allocate() {
+			// calloc hands out lazily zeroed pages for large blocks, no need to clear them
+			auto storage = static_cast<TRegister*>(std::calloc(size, sizeof(TRegister)));
+			if (storage == nullptr) {
+				throw std::bad_alloc();
+			}
+			return storage;
+		}
 
-		TRegister raw[65536];
 	public:
 		Memory() {
-			for (unsigned i = 0; i<65536; i++) {
-				raw[i] = 0;
+			raw = Allocate();
+			release = Free;
+		}
+
+		// takes ownership of storage holding size cells, release is called on destruction
+		Memory(TRegister* storage, Releaser release)
+			: raw(storage),
+			release(release) {}
+
+		Memory(const Memory& other) {
+			raw = Allocate();
+			release = Free;
+			// a moved from memory reads as zero cells, Allocate already zeroes them
+			if (other.raw != nullptr) {
+				std::memcpy(raw, other.raw, size * sizeof(TRegister));
+			}
+		}
+
+		Memory(Memory&& other)
+			: raw(other.raw),
+			release(other.release) {
+			other.raw = nullptr;
+		}
+
+		Memory& operator=(const Memory& other) {
+			if (this != &other) {
+				// a moved from memory has no storage, it gets fresh one before the copy
+				if (raw == nullptr) {
+					raw = Allocate();
+					release = Free;
+				}
+				if (other.raw == nullptr) {
+					std::memset(raw, 0, size * sizeof(TRegister));
+				}
+				else {
+					std::memcpy(raw, other.raw, size * sizeof(TRegister));
+				}
+			}
+			return *this;
+		}
+
+		Memory& operator=(Memory&& other) {
+			std::swap(raw, other.raw);
+			std::swap(release, other.release);
+			return *this;
+		}
+
+		~Memory() {
+			if (raw != nullptr) {
+				release(raw);
 			}
 		}
 
@@ -193,29 +371,233 @@ namespace sikfck {
 		TRegister Read(TPointer pointer) {
 			return raw[pointer & 0xffff];
 		}
+
+		// window[i] = (window[i] & keep[i]) + delta[i] for the cells starting at location, keep is optional
+		void AddBlock(TPointer location, const TRegister* delta, const TRegister* keep, unsigned width) {
+			unsigned start = location & 0xffff;
+			if (start + width <= size) {
+				if (keep == nullptr) {
+					Simd::Add(raw + start, delta, width);
+				}
+				else {
+					Simd::MaskedAdd(raw + start, keep, delta, width);
+				}
+			}
+			else {
+				// window wraps around the end of the tape
+				for (unsigned i = 0; i < width; i++) {
+					unsigned index = (start + i) & 0xffff;
+					raw[index] = (keep == nullptr ? raw[index] : (raw[index] & keep[i])) + delta[i];
+				}
+			}
+		}
+
+		void Clear(TPointer location, unsigned width) {
+			unsigned start = location & 0xffff;
+			if (start + width <= size) {
+				std::memset(raw + start, 0, width * sizeof(TRegister));
+			}
+			else {
+				std::memset(raw + start, 0, (size - start) * sizeof(TRegister));
+				std::memset(raw, 0, (start + width - size) * sizeof(TRegister));
+			}
+		}
+
+		// clears cells from location in steps of stride until a zero cell is found, returns the location of the zero cell
+		TPointer ClearUntilZero(TPointer location, TPointer stride) {
+			if (stride == 1) {
+				// find the end of the run and clear it at once, continue at the start of the tape if it wraps
+				while (true) {
+					unsigned start = location & 0xffff;
+					unsigned end = start;
+					while (end < size && raw[end] != 0) {
+						end++;
+					}
+					std::memset(raw + start, 0, (end - start) * sizeof(TRegister));
+					location += end - start;
+					if (end < size) {
+						return location;
+					}
+				}
+			}
+			if (stride == -1) {
+				while (true) {
+					int start = location & 0xffff;
+					int end = start;
+					while (end >= 0 && raw[end] != 0) {
+						end--;
+					}
+					std::memset(raw + end + 1, 0, (start - end) * sizeof(TRegister));
+					location -= start - end;
+					if (end >= 0) {
+						return location;
+					}
+				}
+			}
+			while (raw[location & 0xffff] != 0) {
+				raw[location & 0xffff] = 0;
+				location += stride;
+			}
+			return location;
+		}
+
+		// repeats { cell[location + offset] += factor * cell[location] for each (offset, factor) in targets;
+		// cell[location] = 0; location += stride } until a zero cell is found, returns the location of the zero cell
+		TPointer MoveUntilZero(TPointer location, TPointer stride, const TRegister* targets, unsigned count) {
+			if ((stride == 1 || stride == -1) && count == 1 && targets[1] == 1 && targets[0] * stride < 0) {
+				// a target never lands on a cell that is still to be moved, so the result does not depend
+				// on the order and the whole block can be moved at once, with memmove where it overlaps
+				int start = location & 0xffff;
+				int end = start;
+				while (end >= 0 && end < static_cast<int>(size) && raw[end] != 0) {
+					end += stride;
+				}
+				int length = stride > 0 ? end - start : start - end;
+				int begin = stride > 0 ? start : end + 1;
+				int offset = static_cast<int>(targets[0]);
+				if (end >= 0 && end < static_cast<int>(size) && begin + offset >= 0 && begin + length + offset <= static_cast<int>(size)) {
+					if (length <= offset || length <= -offset) {
+						Simd::Add(raw + begin + offset, raw + begin, length);
+						std::memset(raw + begin, 0, length * sizeof(TRegister));
+					}
+					else if (offset > 0) {
+						Simd::Add(raw + begin + length, raw + begin + length - offset, offset);
+						std::memmove(raw + begin + offset, raw + begin, (length - offset) * sizeof(TRegister));
+						std::memset(raw + begin, 0, offset * sizeof(TRegister));
+					}
+					else {
+						Simd::Add(raw + begin + offset, raw + begin, -offset);
+						std::memmove(raw + begin, raw + begin - offset, (length + offset) * sizeof(TRegister));
+						std::memset(raw + begin + length + offset, 0, -offset * sizeof(TRegister));
+					}
+					return location + stride * length;
+				}
+			}
+			while (true) {
+				TRegister value = raw[location & 0xffff];
+				if (value == 0) {
+					return location;
+				}
+				for (unsigned i = 0; i < count; i++) {
+					raw[(location + targets[2 * i]) & 0xffff] += targets[2 * i + 1] * value;
+				}
+				raw[location & 0xffff] = 0;
+				location += stride;
+			}
+		}
+
+		const TRegister* Data() const {
+			return raw;
+		}
 	};
 
 	template <typename TRegister, typename TProgramCounter, typename TPointer> class Cpu {
+	public:
+		static const unsigned registerCount = 4;
+
+	private:
 		TProgramCounter programCounter;
 		TPointer pointer;
 		TRegister currentValue;
 		bool dirty;
 		bool zero;
+		size_t inputPosition; // number of bytes consumed from input
+		size_t outputPosition; // number of bytes written to output
+		TRegister registers[registerCount]; // cells promoted by RegLoad, the selected one lives in currentValue
+		unsigned currentRegister;
+		TProgramCounter returnStack[maxCallDepth];
+		unsigned callDepth;
+
+		friend class Checkpoint<TRegister, TProgramCounter, TPointer>;
 
 	public:
 
+		// when set, Run checks the flag on loop back edges and suspends execution if raised
+		const std::atomic<bool>* suspendRequest;
+
 		Cpu() {
 			programCounter = 0;
 			pointer = 0;
 			currentValue = 0;
 			dirty = false;
-			zero = false;
+			zero = true; // consistent with currentValue, a fresh tape is all zero
+			inputPosition = 0;
+			outputPosition = 0;
+			for (unsigned i = 0; i < registerCount; i++) {
+				registers[i] = 0;
+			}
+			currentRegister = 0;
+			callDepth = 0;
+			suspendRequest = nullptr;
+		}
+
+		size_t GetInputPosition() const {
+			return inputPosition;
+		}
+
+		size_t GetOutputPosition() const {
+			return outputPosition;
+		}
+
+		TProgramCounter GetProgramCounter() const {
+			return programCounter;
+		}
+
+		// continue execution at target, used when the program is patched while execution is interrupted
+		void SetProgramCounter(TProgramCounter target) {
+			programCounter = target;
+		}
+
+		TPointer GetPointer() const {
+			return pointer;
+		}
+
+		// writes the cached current cell back, needed before other code uses the tape while execution is interrupted
+		template <typename TMemory> void Flush(TMemory& memory) {
+			if (dirty) {
+				memory.Write(pointer, currentValue);
+				dirty = false;
+			}
+		}
+
+		// continue execution at target with the pointer at location, the current cell is read from the tape again
+		template <typename TMemory> void Resume(TMemory& memory, TProgramCounter target, TPointer location) {
+			Flush(memory);
+			programCounter = target;
+			pointer = location;
+			currentValue = memory.Read(pointer);
+			zero = currentValue == 0;
 		}
 
-		void Run(const Program<TRegister, TProgramCounter>& program, Memory<TRegister, TPointer>& memory) {
+		// convenience overloads, link the program on each call
+		ExecutionResult Run(const Program<TRegister, TProgramCounter>& program, Memory<TRegister, TPointer>& memory) {
+			NullMonitor monitor;
+			return Run(LinkedProgram<TRegister, TProgramCounter>(program), memory, monitor);
+		}
+
+		template <typename TMonitor> ExecutionResult Run(const Program<TRegister, TProgramCounter>& program, Memory<TRegister, TPointer>& memory, TMonitor& monitor) {
+			return Run(LinkedProgram<TRegister, TProgramCounter>(program), memory, monitor);
+		}
+
+		ExecutionResult Run(const LinkedProgram<TRegister, TProgramCounter>& program, Memory<TRegister, TPointer>& memory) {
+			NullMonitor monitor;
+			return Run(program, memory, monitor);
+		}
+
+		template <typename TMonitor> ExecutionResult Run(const LinkedProgram<TRegister, TProgramCounter>& program, Memory<TRegister, TPointer>& memory, TMonitor& monitor) {
+			StandardIo io;
+			return Run(program, memory, io, monitor);
+		}
+
+		// TMemory is Memory or a type with the same access methods wrapping it, like TracingMemory
+		template <typename TMemory, typename TIo, typename TMonitor> ExecutionResult Run(const LinkedProgram<TRegister, TProgramCounter>& program, TMemory& memory, TIo& io, TMonitor& monitor) {
 			while (programCounter < program.GetSize()) {
-				auto instruction = program.Read(programCounter);
-				switch (instruction.type) {
+				auto instruction = program.code[programCounter];
+				InstructionType type = static_cast<InstructionType>(instruction.type);
+				if (!monitor.Step(programCounter, type)) {
+					return ExecutionResult::Interrupted;
+				}
+				switch (type) {
 				case InstructionType::Nop:
 					++programCounter;
 					break;
@@ -288,7 +670,10 @@ namespace sikfck {
 					break;
 				case InstructionType::In:
 					while (instruction.value--) {
-						currentValue = std::getchar();
+						currentValue = io.Read();
+						if (currentValue != EOF) {
+							++inputPosition;
+						}
 					}
 					zero = currentValue == 0;
 					dirty = true;
@@ -296,13 +681,14 @@ namespace sikfck {
 					break;
 				case InstructionType::Out:
 					while (instruction.value--) {
-						std::putchar(currentValue);
+						io.Write(currentValue);
+						++outputPosition;
 					}
 					++programCounter;
 					break;
 				case InstructionType::Jz:
 					if (zero) {
-						programCounter += instruction.value;
+						programCounter = instruction.value;
 					}
 					else {
 						++programCounter;
@@ -310,7 +696,10 @@ namespace sikfck {
 					break;
 				case InstructionType::Jnz:
 					if (!zero) {
-						programCounter += instruction.value;
+						programCounter = instruction.value;
+						if (suspendRequest != nullptr && suspendRequest->load(std::memory_order_relaxed)) {
+							return ExecutionResult::Suspended;
+						}
 					}
 					else {
 						++programCounter;
@@ -322,10 +711,119 @@ namespace sikfck {
 					dirty = true;
 					++programCounter;
 					break;
+				case InstructionType::Block:
+					{
+						// data: base offset, width, pointer move, deltas, optional keep masks
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						unsigned width = static_cast<unsigned>(data[1]);
+						if (dirty) {
+							memory.Write(pointer, currentValue);
+							dirty = false;
+						}
+						memory.AddBlock(pointer + data[0], data + 3, count > static_cast<TRegister>(3 + width) ? data + 3 + width : nullptr, width);
+						pointer += data[2];
+						currentValue = memory.Read(pointer);
+						zero = currentValue == 0;
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::Clear:
+					{
+						// data: base offset, width, pointer move
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						if (dirty) {
+							memory.Write(pointer, currentValue);
+							dirty = false;
+						}
+						memory.Clear(pointer + data[0], static_cast<unsigned>(data[1]));
+						pointer += data[2];
+						currentValue = memory.Read(pointer);
+						zero = currentValue == 0;
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::ClearScan:
+					if (dirty) {
+						memory.Write(pointer, currentValue);
+						dirty = false;
+					}
+					pointer = memory.ClearUntilZero(pointer, instruction.value);
+					currentValue = 0;
+					zero = true;
+					++programCounter;
+					break;
+				case InstructionType::MoveScan:
+					{
+						// data: stride, (offset, factor) pairs
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						if (dirty) {
+							memory.Write(pointer, currentValue);
+							dirty = false;
+						}
+						pointer = memory.MoveUntilZero(pointer, data[0], data + 1, static_cast<unsigned>(count - 1) / 2);
+						currentValue = 0;
+						zero = true;
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::RegLoad:
+					{
+						// data: cell offsets, the first one is 0 so register 0 is the current cell
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						if (dirty) {
+							memory.Write(pointer, currentValue);
+							dirty = false;
+						}
+						for (TRegister i = 0; i < count; i++) {
+							registers[i] = memory.Read(pointer + data[i]);
+						}
+						currentRegister = 0;
+						currentValue = registers[0];
+						zero = currentValue == 0;
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::RegSelect:
+					registers[currentRegister] = currentValue;
+					currentRegister = instruction.value;
+					currentValue = registers[currentRegister];
+					zero = currentValue == 0;
+					++programCounter;
+					break;
+				case InstructionType::RegStore:
+					{
+						// data: cell offsets as for RegLoad, register 0 is selected again when the loop exits
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						registers[currentRegister] = currentValue;
+						for (TRegister i = 0; i < count; i++) {
+							memory.Write(pointer + data[i], registers[i]);
+						}
+						currentRegister = 0;
+						currentValue = registers[0];
+						dirty = false;
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::Call:
+					if (callDepth == maxCallDepth) {
+						throw std::runtime_error("Return stack overflow.");
+					}
+					returnStack[callDepth++] = programCounter + 1;
+					programCounter = instruction.value;
+					break;
+				case InstructionType::Ret:
+					programCounter = callDepth == 0 ? program.GetSize() : returnStack[--callDepth];
+					break;
 				default:
 					throw std::invalid_argument("Illegal instruction.");
 				}
 			}
+			return ExecutionResult::Halted;
 		}
 	};
 
@@ -0,0 +1,442 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Runs one program for many inputs, Lanes of them at a time in lockstep.
+	// The tapes of the lanes are interleaved, cell c of lane l is tape[c * Lanes + l], so an instruction updates
+	// the cell of every lane with one Simd kernel call. A mask selects the lanes that execute: at a Jz or Jnz where
+	// some lanes leave the loop those wait at the loop exit until the others follow, and are masked back in there.
+	// A lane splits off to a scalar Cpu on a copy of its tape when it can not rejoin the others, because its pointer
+	// differs after a scan or at the loop exit, or when waiting lanes make up too much of the lockstep work.
+	// Call and MulM of the current cell are not run in lockstep, all lanes split off when they are reached.
+	template <typename TRegister, typename TProgramCounter, typename TPointer, unsigned Lanes = 8> class BatchCpu {
+		static_assert(Lanes >= 1 && Lanes <= 32, "lanes must fit in the 32 bit mask");
+
+	public:
+		static const unsigned size = Memory<TRegister, TPointer>::size;
+
+		// input and collected output of one lane
+		class LaneIo {
+		public:
+			const std::string* input;
+			size_t consumed;
+			std::string output;
+
+			LaneIo()
+				: input(nullptr),
+				consumed(0) {}
+
+			int Read() {
+				return consumed < input->size() ? static_cast<unsigned char>((*input)[consumed++]) : EOF;
+			}
+
+			void Write(int value) {
+				output.push_back(static_cast<char>(value));
+			}
+		};
+
+		// waiting lanes are split off when they take more than this share of the lane steps in a window
+		unsigned divergenceWindow = 4096;
+		unsigned divergencePercent = 50;
+
+	private:
+		// lanes that entered a loop together, lanes masked out inside the loop continue at exit
+		struct Frame {
+			TProgramCounter exit;
+			uint32_t mask;
+		};
+
+		std::vector<TRegister> tape;
+		LaneIo io[Lanes];
+		TRegister laneMask[Lanes]; // all bits set for lanes in active, zero otherwise
+		TPointer lanePointer[Lanes]; // pointer of a lane waiting at the exit of its frame
+		std::vector<Frame> frames;
+		uint32_t live; // lanes still running in lockstep
+		uint32_t active; // live lanes executing the current instruction
+		TPointer pointer;
+		TPointer registerBase; // pointer at RegLoad, RegSelect moves the pointer to the promoted cells
+		const TRegister* registerOffsets;
+		uint64_t windowSteps;
+		uint64_t laneSteps;
+		uint64_t waitingSteps;
+		size_t splitLanes;
+		uint64_t lockstepInstructions;
+
+		TRegister* Cell(TPointer location) {
+			return &tape[(location & 0xffff) * Lanes];
+		}
+
+		void SetActive(uint32_t mask) {
+			active = mask;
+			for (unsigned l = 0; l < Lanes; l++) {
+				laneMask[l] = (active >> l) & 1 ? ~static_cast<TRegister>(0) : 0;
+			}
+		}
+
+		uint32_t ZeroLanes(TPointer location) {
+			const TRegister* cell = Cell(location);
+			uint32_t zero = 0;
+			for (unsigned l = 0; l < Lanes; l++) {
+				zero |= cell[l] == 0 ? 1u << l : 0;
+			}
+			return zero & active;
+		}
+
+		// masked add of value to the cells at location
+		void Add(TPointer location, TRegister value) {
+			TRegister delta[Lanes];
+			for (unsigned l = 0; l < Lanes; l++) {
+				delta[l] = value & laneMask[l];
+			}
+			Simd::Add(Cell(location), delta, Lanes);
+		}
+
+		// masked cell = (cell & keep) + delta
+		void Update(TPointer location, TRegister keep, TRegister value) {
+			TRegister keepLanes[Lanes];
+			TRegister delta[Lanes];
+			for (unsigned l = 0; l < Lanes; l++) {
+				keepLanes[l] = keep | ~laneMask[l];
+				delta[l] = value & laneMask[l];
+			}
+			Simd::MaskedAdd(Cell(location), keepLanes, delta, Lanes);
+		}
+
+		static unsigned Count(uint32_t mask) {
+			unsigned count = 0;
+			for (; mask != 0; mask &= mask - 1) {
+				count++;
+			}
+			return count;
+		}
+
+		// continues lane on a scalar Cpu at target until the program ends
+		void Split(const LinkedProgram<TRegister, TProgramCounter>& program, unsigned lane, TProgramCounter target, TPointer location) {
+			if (target < program.GetSize() && static_cast<InstructionType>(program.code[target].type) == InstructionType::RegStore) {
+				// the cells of a promoted loop are up to date on the tape, the scalar Cpu has nothing to store
+				target += program.constants[program.code[target].value] + 1;
+			}
+			Memory<TRegister, TPointer> memory;
+			for (unsigned c = 0; c < size; c++) {
+				memory.Write(c, tape[c * Lanes + lane]);
+			}
+			Cpu<TRegister, TProgramCounter, TPointer> cpu;
+			NullMonitor monitor;
+			cpu.Resume(memory, target, location);
+			cpu.Run(program, memory, io[lane], monitor);
+			live &= ~(1u << lane);
+			splitLanes++;
+		}
+
+		// splits off the lanes waiting at the exit of a frame
+		void SplitWaiting(const LinkedProgram<TRegister, TProgramCounter>& program) {
+			for (size_t f = frames.size(); f-- > 0;) {
+				uint32_t waiting = frames[f].mask & live & ~active;
+				for (unsigned l = 0; l < Lanes; l++) {
+					if ((waiting >> l) & 1) {
+						Split(program, l, frames[f].exit, lanePointer[l]);
+					}
+				}
+			}
+		}
+
+		// after a scan every active lane may stop at another cell, the ones not ending where the first one did split off
+		void Rejoin(const LinkedProgram<TRegister, TProgramCounter>& program, const TPointer* end, TProgramCounter next) {
+			unsigned first = 0;
+			while (((active >> first) & 1) == 0) {
+				first++;
+			}
+			pointer = end[first];
+			uint32_t stay = active;
+			for (unsigned l = first + 1; l < Lanes; l++) {
+				if (((active >> l) & 1) && end[l] != pointer) {
+					Split(program, l, next, end[l]);
+					stay &= ~(1u << l);
+				}
+			}
+			SetActive(stay);
+		}
+
+		void Wait(uint32_t lanes) {
+			for (unsigned l = 0; l < Lanes; l++) {
+				if ((lanes >> l) & 1) {
+					lanePointer[l] = pointer;
+				}
+			}
+			SetActive(active & ~lanes);
+		}
+
+		void RunLockstep(const LinkedProgram<TRegister, TProgramCounter>& program) {
+			TProgramCounter programCounter = 0;
+			while (programCounter < program.GetSize() && active != 0) {
+				auto instruction = program.code[programCounter];
+				InstructionType type = static_cast<InstructionType>(instruction.type);
+				TRegister* cell = Cell(pointer);
+				switch (type) {
+				case InstructionType::Nop:
+					++programCounter;
+					break;
+				case InstructionType::Add:
+					Add(pointer, instruction.value);
+					++programCounter;
+					break;
+				case InstructionType::Set:
+					Update(pointer, 0, instruction.value);
+					++programCounter;
+					break;
+				case InstructionType::AddPi:
+				case InstructionType::AddPd:
+					Add(pointer, instruction.value);
+					pointer += type == InstructionType::AddPi ? 1 : -1;
+					++programCounter;
+					break;
+				case InstructionType::PtrAdd:
+					pointer += instruction.value;
+					++programCounter;
+					break;
+				case InstructionType::AddM:
+				case InstructionType::SubM:
+					if (type == InstructionType::SubM && instruction.value == 0) {
+						Update(pointer, 0, 0);
+					}
+					else {
+						TRegister delta[Lanes];
+						for (unsigned l = 0; l < Lanes; l++) {
+							delta[l] = (type == InstructionType::AddM ? cell[l] : -cell[l]) & laneMask[l];
+						}
+						Simd::Add(Cell(pointer + instruction.value), delta, Lanes);
+					}
+					++programCounter;
+					break;
+				case InstructionType::MulM:
+					if (instruction.value == 0) {
+						SplitWaiting(program);
+						for (unsigned l = 0; l < Lanes; l++) {
+							if ((active >> l) & 1) {
+								Split(program, l, programCounter, pointer);
+							}
+						}
+						return;
+					}
+					{
+						TRegister* target = Cell(pointer + instruction.value);
+						for (unsigned l = 0; l < Lanes; l++) {
+							target[l] = (active >> l) & 1 ? target[l] * cell[l] : target[l];
+						}
+					}
+					++programCounter;
+					break;
+				case InstructionType::In:
+					for (unsigned l = 0; l < Lanes; l++) {
+						if ((active >> l) & 1) {
+							for (TRegister n = 0; n < instruction.value; n++) {
+								cell[l] = io[l].Read();
+							}
+						}
+					}
+					++programCounter;
+					break;
+				case InstructionType::Out:
+					for (unsigned l = 0; l < Lanes; l++) {
+						if ((active >> l) & 1) {
+							for (TRegister n = 0; n < instruction.value; n++) {
+								io[l].Write(cell[l]);
+							}
+						}
+					}
+					++programCounter;
+					break;
+				case InstructionType::Jz:
+					{
+						// the target is the matching Jnz, lanes skipping the loop continue after it
+						uint32_t zero = ZeroLanes(pointer);
+						if (zero == active) {
+							programCounter = instruction.value + 1;
+							break;
+						}
+						frames.push_back(Frame{ static_cast<TProgramCounter>(instruction.value + 1), active });
+						Wait(zero);
+						++programCounter;
+					}
+					break;
+				case InstructionType::Jnz:
+					{
+						uint32_t zero = ZeroLanes(pointer);
+						if (zero != active) {
+							// the target is the matching Jz, the lanes looping know their cell is not zero
+							Wait(zero);
+							programCounter = instruction.value + 1;
+							break;
+						}
+						// every lane left the loop, the ones waiting at a different cell can not follow
+						Frame frame = frames.back();
+						frames.pop_back();
+						uint32_t rejoining = frame.mask & live & ~active;
+						uint32_t stay = frame.mask & live;
+						for (unsigned l = 0; l < Lanes; l++) {
+							if (((rejoining >> l) & 1) && lanePointer[l] != pointer) {
+								Split(program, l, frame.exit, lanePointer[l]);
+								stay &= ~(1u << l);
+							}
+						}
+						SetActive(stay);
+						++programCounter;
+					}
+					break;
+				case InstructionType::Block:
+				case InstructionType::Clear:
+					{
+						// data: base offset, width, pointer move, for Block deltas and optional keep masks
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						unsigned width = static_cast<unsigned>(data[1]);
+						bool keep = type == InstructionType::Block && count > static_cast<TRegister>(3 + width);
+						for (unsigned i = 0; i < width; i++) {
+							if (type == InstructionType::Clear) {
+								Update(pointer + data[0] + i, 0, 0);
+							}
+							else {
+								Update(pointer + data[0] + i, keep ? data[3 + width + i] : ~static_cast<TRegister>(0), data[3 + i]);
+							}
+						}
+						pointer += data[2];
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::ClearScan:
+					{
+						TPointer end[Lanes];
+						for (unsigned l = 0; l < Lanes; l++) {
+							if ((active >> l) & 1) {
+								TPointer location = pointer;
+								while (Cell(location)[l] != 0) {
+									Cell(location)[l] = 0;
+									location += instruction.value;
+								}
+								end[l] = location;
+							}
+						}
+						Rejoin(program, end, programCounter + 1);
+						++programCounter;
+					}
+					break;
+				case InstructionType::MoveScan:
+					{
+						// data: stride, (offset, factor) pairs
+						TRegister count = program.constants[instruction.value];
+						const TRegister* data = &program.constants[instruction.value + 1];
+						unsigned targets = static_cast<unsigned>(count - 1) / 2;
+						TPointer end[Lanes];
+						for (unsigned l = 0; l < Lanes; l++) {
+							if ((active >> l) & 1) {
+								TPointer location = pointer;
+								TRegister value;
+								while ((value = Cell(location)[l]) != 0) {
+									for (unsigned t = 0; t < targets; t++) {
+										Cell(location + data[1 + 2 * t])[l] += data[2 + 2 * t] * value;
+									}
+									Cell(location)[l] = 0;
+									location += data[0];
+								}
+								end[l] = location;
+							}
+						}
+						Rejoin(program, end, programCounter + count + 1);
+						programCounter += count + 1;
+					}
+					break;
+				case InstructionType::RegLoad:
+					// the cells stay on the tape, registers only change which cell the pointer is on
+					registerBase = pointer;
+					registerOffsets = &program.constants[instruction.value + 1];
+					programCounter += program.constants[instruction.value] + 1;
+					break;
+				case InstructionType::RegSelect:
+					pointer = registerBase + registerOffsets[instruction.value];
+					++programCounter;
+					break;
+				case InstructionType::RegStore:
+					pointer = registerBase;
+					programCounter += program.constants[instruction.value] + 1;
+					break;
+				case InstructionType::Ret:
+					// only the Ret ending the program is reached, calls are not run in lockstep
+					programCounter = program.GetSize();
+					break;
+				case InstructionType::Call:
+					SplitWaiting(program);
+					for (unsigned l = 0; l < Lanes; l++) {
+						if ((active >> l) & 1) {
+							Split(program, l, programCounter, pointer);
+						}
+					}
+					return;
+				default:
+					throw std::invalid_argument("Illegal instruction.");
+				}
+
+				lockstepInstructions++;
+				laneSteps += Count(live);
+				waitingSteps += Count(live & ~active);
+				if (++windowSteps == divergenceWindow) {
+					if (waitingSteps * 100 > laneSteps * divergencePercent) {
+						SplitWaiting(program);
+					}
+					windowSteps = 0;
+					laneSteps = 0;
+					waitingSteps = 0;
+				}
+			}
+		}
+
+	public:
+		BatchCpu()
+			: tape(static_cast<size_t>(size) * Lanes),
+			splitLanes(0),
+			lockstepInstructions(0) {}
+
+		// runs the program once for each input and returns the output of each run
+		std::vector<std::string> Run(const LinkedProgram<TRegister, TProgramCounter>& program, const std::vector<std::string>& inputs) {
+			std::vector<std::string> outputs(inputs.size());
+			for (size_t first = 0; first < inputs.size(); first += Lanes) {
+				unsigned count = static_cast<unsigned>(std::min<size_t>(Lanes, inputs.size() - first));
+				std::fill(tape.begin(), tape.end(), 0);
+				for (unsigned l = 0; l < Lanes; l++) {
+					io[l] = LaneIo();
+					io[l].input = l < count ? &inputs[first + l] : nullptr;
+				}
+				frames.clear();
+				live = count == 32 ? ~0u : (1u << count) - 1;
+				SetActive(live);
+				pointer = 0;
+				registerBase = 0;
+				registerOffsets = nullptr;
+				windowSteps = 0;
+				laneSteps = 0;
+				waitingSteps = 0;
+				RunLockstep(program);
+				for (unsigned l = 0; l < count; l++) {
+					outputs[first + l] = std::move(io[l].output);
+				}
+			}
+			return outputs;
+		}
+
+		// lanes that finished on a scalar Cpu
+		size_t GetSplitLaneCount() const {
+			return splitLanes;
+		}
+
+		// instructions executed in lockstep, each for all active lanes
+		uint64_t GetLockstepInstructionCount() const {
+			return lockstepInstructions;
+		}
+	};
+
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Saves and restores the complete state of a running program.
+	// Only non-zero memory pages are stored, each page is run length encoded.
+	// All numbers are written as variable length integers so the file does not depend on endianness.
+	template <typename TRegister, typename TProgramCounter, typename TPointer> class Checkpoint {
+	public:
+		static const uint32_t magic = 0x4b434b53; // "SKCK"
+		static const uint32_t version = 3;
+		static const unsigned pageSize = 256;
+
+		// identifies the program a checkpoint belongs to, FNV-1a over the bytecode
+		static uint64_t ProgramHash(const Program<TRegister, TProgramCounter>& program)
+		{
+			uint64_t hash = 14695981039346656037ull;
+			for (TProgramCounter i = 0; i < program.GetSize(); i++)
+			{
+				hash = (hash ^ static_cast<uint64_t>(program.itype[i])) * 1099511628211ull;
+				hash = (hash ^ static_cast<uint64_t>(static_cast<int64_t>(program.ivalue[i]))) * 1099511628211ull;
+			}
+			return hash;
+		}
+
+		static void Save(std::ostream& out, const Program<TRegister, TProgramCounter>& program, const Cpu<TRegister, TProgramCounter, TPointer>& cpu, Memory<TRegister, TPointer>& memory)
+		{
+			WriteUnsigned(out, magic);
+			WriteUnsigned(out, version);
+			WriteUnsigned(out, ProgramHash(program));
+
+			WriteUnsigned(out, static_cast<uint64_t>(cpu.programCounter));
+			WriteSigned(out, static_cast<int64_t>(cpu.pointer));
+			WriteSigned(out, static_cast<int64_t>(cpu.currentValue));
+			out.put(static_cast<char>((cpu.dirty ? 1 : 0) | (cpu.zero ? 2 : 0)));
+			WriteUnsigned(out, cpu.inputPosition);
+			WriteUnsigned(out, cpu.outputPosition);
+			WriteUnsigned(out, cpu.currentRegister);
+			for (unsigned i = 0; i < cpu.registerCount; i++)
+			{
+				WriteSigned(out, static_cast<int64_t>(cpu.registers[i]));
+			}
+			WriteUnsigned(out, cpu.callDepth);
+			for (unsigned i = 0; i < cpu.callDepth; i++)
+			{
+				WriteUnsigned(out, static_cast<uint64_t>(cpu.returnStack[i]));
+			}
+
+			const unsigned pageCount = Memory<TRegister, TPointer>::size / pageSize;
+			unsigned usedPages = 0;
+			for (unsigned page = 0; page < pageCount; page++)
+			{
+				if (!IsPageEmpty(memory, page))
+				{
+					usedPages++;
+				}
+			}
+			WriteUnsigned(out, usedPages);
+
+			for (unsigned page = 0; page < pageCount; page++)
+			{
+				if (IsPageEmpty(memory, page))
+				{
+					continue;
+				}
+				WriteUnsigned(out, page);
+				// pairs of (run length, value)
+				unsigned begin = page * pageSize;
+				unsigned end = begin + pageSize;
+				unsigned i = begin;
+				while (i < end)
+				{
+					TRegister value = memory.Read(i);
+					unsigned run = 1;
+					while (i + run < end && memory.Read(i + run) == value)
+					{
+						run++;
+					}
+					WriteUnsigned(out, run);
+					WriteSigned(out, static_cast<int64_t>(value));
+					i += run;
+				}
+			}
+
+			if (!out)
+			{
+				throw std::runtime_error("Failed to write checkpoint.");
+			}
+		}
+
+		static void Load(std::istream& in, const Program<TRegister, TProgramCounter>& program, Cpu<TRegister, TProgramCounter, TPointer>& cpu, Memory<TRegister, TPointer>& memory)
+		{
+			if (ReadUnsigned(in) != magic)
+			{
+				throw std::runtime_error("Not a checkpoint file.");
+			}
+			if (ReadUnsigned(in) != version)
+			{
+				throw std::runtime_error("Unsupported checkpoint version.");
+			}
+			if (ReadUnsigned(in) != ProgramHash(program))
+			{
+				throw std::runtime_error("Checkpoint was created for a different program.");
+			}
+
+			Cpu<TRegister, TProgramCounter, TPointer> state;
+			state.programCounter = static_cast<TProgramCounter>(ReadUnsigned(in));
+			state.pointer = static_cast<TPointer>(ReadSigned(in));
+			state.currentValue = static_cast<TRegister>(ReadSigned(in));
+			int flags = in.get();
+			state.dirty = (flags & 1) != 0;
+			state.zero = (flags & 2) != 0;
+			state.inputPosition = static_cast<size_t>(ReadUnsigned(in));
+			state.outputPosition = static_cast<size_t>(ReadUnsigned(in));
+			state.currentRegister = static_cast<unsigned>(ReadUnsigned(in));
+			for (unsigned i = 0; i < state.registerCount; i++)
+			{
+				state.registers[i] = static_cast<TRegister>(ReadSigned(in));
+			}
+			state.callDepth = static_cast<unsigned>(ReadUnsigned(in));
+			if (state.callDepth > maxCallDepth)
+			{
+				throw std::runtime_error("Corrupt checkpoint.");
+			}
+			for (unsigned i = 0; i < state.callDepth; i++)
+			{
+				state.returnStack[i] = static_cast<TProgramCounter>(ReadUnsigned(in));
+			}
+			state.suspendRequest = cpu.suspendRequest;
+
+			if (state.programCounter > program.GetSize() || state.currentRegister >= state.registerCount)
+			{
+				throw std::runtime_error("Corrupt checkpoint.");
+			}
+
+			const unsigned pageCount = Memory<TRegister, TPointer>::size / pageSize;
+			for (unsigned i = 0; i < Memory<TRegister, TPointer>::size; i++)
+			{
+				memory.Write(i, 0);
+			}
+
+			uint64_t usedPages = ReadUnsigned(in);
+			for (uint64_t n = 0; n < usedPages; n++)
+			{
+				uint64_t page = ReadUnsigned(in);
+				if (page >= pageCount)
+				{
+					throw std::runtime_error("Corrupt checkpoint.");
+				}
+				unsigned i = static_cast<unsigned>(page) * pageSize;
+				unsigned end = i + pageSize;
+				while (i < end)
+				{
+					uint64_t run = ReadUnsigned(in);
+					TRegister value = static_cast<TRegister>(ReadSigned(in));
+					if (run == 0 || run > end - i)
+					{
+						throw std::runtime_error("Corrupt checkpoint.");
+					}
+					for (uint64_t j = 0; j < run; j++)
+					{
+						memory.Write(i++, value);
+					}
+				}
+			}
+
+			cpu = state;
+		}
+
+	private:
+
+		static bool IsPageEmpty(Memory<TRegister, TPointer>& memory, unsigned page)
+		{
+			for (unsigned i = page * pageSize; i < (page + 1) * pageSize; i++)
+			{
+				if (memory.Read(i) != 0)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		static void WriteUnsigned(std::ostream& out, uint64_t value)
+		{
+			while (value >= 0x80)
+			{
+				out.put(static_cast<char>((value & 0x7f) | 0x80));
+				value >>= 7;
+			}
+			out.put(static_cast<char>(value));
+		}
+
+		static void WriteSigned(std::ostream& out, int64_t value)
+		{
+			// zigzag encoding keeps small negative numbers short
+			WriteUnsigned(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+		}
+
+		static uint64_t ReadUnsigned(std::istream& in)
+		{
+			uint64_t value = 0;
+			for (unsigned shift = 0; shift < 64; shift += 7)
+			{
+				int c = in.get();
+				if (c == EOF)
+				{
+					throw std::runtime_error("Unexpected end of checkpoint.");
+				}
+				value |= static_cast<uint64_t>(c & 0x7f) << shift;
+				if ((c & 0x80) == 0)
+				{
+					return value;
+				}
+			}
+			throw std::runtime_error("Corrupt checkpoint.");
+		}
+
+		static int64_t ReadSigned(std::istream& in)
+		{
+			uint64_t value = ReadUnsigned(in);
+			return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+		}
+	};
+
+}
@@ -1,6 +1,10 @@
 #pragma once
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
 #include <vector>
 #include "sikfck.h"
+#include "sikfckLoopPattern.h"
 #include <memory>
 
 namespace sikfck {
@@ -15,6 +19,12 @@ namespace sikfck {
 			return false;
 		}
 
+		// loops that can not match the pattern are not passed to TryPerform
+		virtual LoopPattern Pattern() const
+		{
+			return LoopPattern::Any();
+		}
+
 		virtual ~LoopOptimization()
 		{
 
@@ -25,6 +35,13 @@ namespace sikfck {
 	private:
 
 		std::vector<std::unique_ptr<LoopOptimization<typename TRegister, typename TProgramCounter>>> loopOptimizations;
+		std::vector<int> loopPatternStates; // final automaton state of each loop optimization, -1 if it is always tried
+		LoopPatternAutomaton loopPatterns;
+		std::vector<int> optimizedLoops; // per input instruction of the current pass, index in optimizedLoopCode of the loop starting there, -1 if none
+		std::vector<Program<TRegister, TProgramCounter>> optimizedLoopCode;
+		std::chrono::steady_clock::time_point deadline;
+		size_t instructionsSpent = 0;
+		size_t loopsSkipped = 0;
 
 		class OptimisationInfo
 		{
@@ -63,6 +80,125 @@ namespace sikfck {
 			}
 		}
 
+		static const int maxBlockWidth = 16;
+
+		// Folds a run of Add, AddPi, AddPd, Set and PtrAdd into one Block instruction followed by data words:
+		// base offset, width, pointer move, per cell deltas and, if the run contains sets, per cell keep masks.
+		// Returns the number of input instructions folded, or the negative length of the run if folding does not pay off.
+		int TryFoldBlock(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end)
+		{
+			TRegister delta[2 * maxBlockWidth + 1] = {};
+			bool set[2 * maxBlockWidth + 1] = {};
+			bool touched[2 * maxBlockWidth + 1] = {};
+			int offset = 0, low = 0, high = 0;
+			int cells = 0;
+			bool anySet = false;
+			TProgramCounter i = begin;
+			for (; i < end; ++i)
+			{
+				InstructionType type = input.itype[i];
+				TRegister value = input.ivalue[i];
+				int move = 0;
+				if (type == InstructionType::PtrAdd)
+				{
+					offset += static_cast<int>(value);
+					continue;
+				}
+				else if (type == InstructionType::AddPi)
+				{
+					move = +1;
+				}
+				else if (type == InstructionType::AddPd)
+				{
+					move = -1;
+				}
+				else if (type != InstructionType::Add && type != InstructionType::Set)
+				{
+					break;
+				}
+
+				// the cell must stay inside the window
+				int newLow = cells == 0 ? offset : std::min(low, offset);
+				int newHigh = cells == 0 ? offset : std::max(high, offset);
+				if (offset < -maxBlockWidth || offset > maxBlockWidth || newHigh - newLow >= maxBlockWidth)
+				{
+					break;
+				}
+				low = newLow;
+				high = newHigh;
+				int index = offset + maxBlockWidth;
+				if (!touched[index])
+				{
+					touched[index] = true;
+					cells++;
+				}
+				if (type == InstructionType::Set)
+				{
+					set[index] = true;
+					anySet = true;
+					delta[index] = value;
+				}
+				else
+				{
+					delta[index] += value;
+				}
+				offset += move;
+			}
+
+			int length = static_cast<int>(i - begin);
+			if (cells < 3)
+			{
+				return -length;
+			}
+
+			InstructionDebug<TRegister> first = input.ReadDebug(begin);
+			InstructionDebug<TRegister> last = input.ReadDebug(i - 1);
+			int width = high - low + 1;
+
+			// a contiguous range of cells set to zero becomes a Clear
+			bool clearOnly = true;
+			for (int o = low; o <= high; o++)
+			{
+				if (!set[o + maxBlockWidth] || delta[o + maxBlockWidth] != 0)
+				{
+					clearOnly = false;
+				}
+			}
+
+			InstructionDebug<TRegister> word(InstructionType::Block, 3 + width * (anySet ? 2 : 1), first.sourceBegin, last.sourceEnd, first.sourceLine, first.sourceColumn);
+			if (clearOnly)
+			{
+				word.type = InstructionType::Clear;
+				word.value = 3;
+			}
+			output.Append(word);
+			word.type = InstructionType::Data;
+			word.value = low;
+			output.Append(word);
+			word.value = width;
+			output.Append(word);
+			word.value = offset;
+			output.Append(word);
+			if (clearOnly)
+			{
+				return length;
+			}
+			for (int o = low; o <= high; o++)
+			{
+				word.value = delta[o + maxBlockWidth];
+				output.Append(word);
+			}
+			if (anySet)
+			{
+				for (int o = low; o <= high; o++)
+				{
+					word.value = set[o + maxBlockWidth] ? 0 : ~static_cast<TRegister>(0);
+					output.Append(word);
+				}
+			}
+			return length;
+		}
+
 		OptimisationInfo OptimizeFlat(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end)
 		{
 			if (verboseOptimisation)
@@ -73,8 +209,23 @@ namespace sikfck {
 			TProgramCounter outBegin = output.GetSize();
 			TProgramCounter startingOutputSize = output.GetSize();
 			InstructionDebug<TRegister> previous(InstructionType::Nop, 0, 0, 0, 0, 0);
+			TProgramCounter foldableFrom = begin;
 			for (TProgramCounter i = begin; i<end; ++i)
 			{
+				if (i >= foldableFrom)
+				{
+					TProgramCounter blockIndex = output.GetSize();
+					int folded = TryFoldBlock(input, output, i, end);
+					if (folded > 0)
+					{
+						info.pointerDelta += output.ivalue[blockIndex + 3];
+						previous = output.ReadDebug(blockIndex);
+						i += folded - 1;
+						continue;
+					}
+					// do not retry inside a run that was not worth folding
+					foldableFrom = i + std::max(-folded, 1);
+				}
 				InstructionDebug<TRegister> instruction = input.ReadDebug(i);
 				switch (instruction.type)
 				{
@@ -149,14 +300,22 @@ namespace sikfck {
 			auto startingOutputSize = output.GetSize();
 			auto patternMatched = false;
 
-			for (auto& optimizer : loopOptimizations)
+			// the loop optimizations already ran in OptimizeLoopsByBenefit, their code is position independent
+			if (optimizedLoops[begin] >= 0)
 			{
-				bool success = optimizer->TryPerform(input, output, begin, end);
-				if (success)
+				const Program<TRegister, TProgramCounter>& code = optimizedLoopCode[optimizedLoops[begin]];
+				for (TProgramCounter i = 0; i < code.GetSize(); ++i)
 				{
-					patternMatched = true;
-					break;
+					if (code.debug)
+					{
+						output.Append(code.ReadDebug(i));
+					}
+					else
+					{
+						output.Append(code.Read(i));
+					}
 				}
+				patternMatched = true;
 			}
 
 			if (patternMatched)
@@ -304,6 +463,222 @@ namespace sikfck {
 			return info;
 		}
 
+		// Value tracking: after a loop exits, and after Set 0, the current cell is known to be zero.
+		// A loop entered on a known zero cell is never executed and an addition to a known zero cell is a set.
+		// Jump offsets are recomputed since removed loops change the distances.
+		void PropagateKnownZero(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end)
+		{
+			std::vector<TProgramCounter> loopStack;
+			bool knownZero = false;
+			TProgramCounter i = begin;
+			while (i < end)
+			{
+				InstructionDebug<TRegister> instruction = input.ReadDebug(i);
+				switch (instruction.type)
+				{
+				case InstructionType::Jz:
+					if (knownZero)
+					{
+						// dead loop, skip to after the matching Jnz
+						i += instruction.value + 1;
+						continue;
+					}
+					loopStack.push_back(output.GetSize());
+					output.Append(instruction);
+					break;
+				case InstructionType::Jnz:
+					{
+						TProgramCounter loopBegin = loopStack.back();
+						loopStack.pop_back();
+						InstructionDebug<TRegister> jz = output.ReadDebug(loopBegin);
+						jz.value = output.GetSize() - loopBegin;
+						output.Replace(loopBegin, jz);
+						instruction.value = loopBegin - output.GetSize();
+						output.Append(instruction);
+						knownZero = true;
+					}
+					break;
+				case InstructionType::Add:
+					if (knownZero)
+					{
+						instruction.type = InstructionType::Set;
+					}
+					knownZero = instruction.type == InstructionType::Set && instruction.value == 0;
+					output.Append(instruction);
+					break;
+				case InstructionType::Set:
+					knownZero = instruction.value == 0;
+					output.Append(instruction);
+					break;
+				case InstructionType::ClearScan:
+				case InstructionType::MoveScan:
+				case InstructionType::RegStore:
+					knownZero = true;
+					output.Append(instruction);
+					break;
+				case InstructionType::AddM:
+				case InstructionType::SubM:
+				case InstructionType::MulM:
+				case InstructionType::Out:
+				case InstructionType::Nop:
+				case InstructionType::Data:
+					// current cell stays the same
+					output.Append(instruction);
+					break;
+				default:
+					knownZero = false;
+					output.Append(instruction);
+					break;
+				}
+				++i;
+			}
+		}
+
+		// Cost model: a loop nested d levels deep is assumed to run 8^d times as often as top level code,
+		// so optimizing it saves about its length times 8^d executed instructions. The loop optimizations are tried
+		// on the loops in the order of that benefit until the budget is spent, the remaining loops are copied as they are.
+		// A loop is charged only its direct body, nested loops are charged as their own candidates.
+		void OptimizeLoopsByBenefit(const Program<TRegister, TProgramCounter>& input)
+		{
+			struct Candidate
+			{
+				TProgramCounter begin;
+				TProgramCounter length;
+				TProgramCounter body;
+				uint64_t benefit;
+			};
+			std::vector<Candidate> candidates;
+			// indices into candidates of the loops enclosing the current instruction
+			std::vector<size_t> open;
+			for (TProgramCounter i = 0; i < input.GetSize(); ++i)
+			{
+				if (input.itype[i] == InstructionType::Jz)
+				{
+					TProgramCounter length = input.ivalue[i] + 1;
+					unsigned shift = 3 * std::min(static_cast<unsigned>(open.size()), 16u);
+					uint64_t wideLength = static_cast<uint64_t>(length);
+					uint64_t benefit = wideLength > (UINT64_MAX >> shift) ? UINT64_MAX : wideLength << shift;
+					if (!open.empty())
+					{
+						candidates[open.back()].body -= length;
+					}
+					open.push_back(candidates.size());
+					candidates.push_back(Candidate{ i, length, length, benefit });
+				}
+				else if (input.itype[i] == InstructionType::Jnz && !open.empty())
+				{
+					open.pop_back();
+				}
+			}
+			std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.benefit > b.benefit; });
+
+			optimizedLoops.assign(input.GetSize(), -1);
+			optimizedLoopCode.clear();
+			loopsSkipped = 0;
+			for (const Candidate& candidate : candidates)
+			{
+				size_t cost = static_cast<size_t>(candidate.body);
+				if (optimizationLevel < 2
+					|| (compileInstructionBudget > 0 && instructionsSpent + cost > compileInstructionBudget)
+					|| (compileTimeBudget > 0 && std::chrono::steady_clock::now() > deadline))
+				{
+					loopsSkipped++;
+					continue;
+				}
+				instructionsSpent += cost;
+
+				TProgramCounter end = candidate.begin + candidate.length;
+				uint64_t matched = loopPatterns.Run(input, candidate.begin + 1, end - 1);
+				Program<TRegister, TProgramCounter> code;
+				code.debug = input.debug;
+				for (size_t k = 0; k < loopOptimizations.size(); k++)
+				{
+					int state = loopPatternStates[k];
+					if (state >= 0 && ((matched >> state) & 1) == 0)
+					{
+						continue;
+					}
+					if (loopOptimizations[k]->TryPerform(input, code, candidate.begin, end))
+					{
+						optimizedLoops[candidate.begin] = static_cast<int>(optimizedLoopCode.size());
+						optimizedLoopCode.push_back(std::move(code));
+						break;
+					}
+				}
+			}
+		}
+
+		bool BudgetSpent() const
+		{
+			return (compileInstructionBudget > 0 && instructionsSpent >= compileInstructionBudget)
+				|| (compileTimeBudget > 0 && std::chrono::steady_clock::now() > deadline);
+		}
+
+		Program<TRegister, TProgramCounter> OptimizePasses(const Program<TRegister, TProgramCounter>& input, size_t pass)
+		{
+			Program<TRegister, TProgramCounter> output;
+			output.debug = input.debug;
+			output.source = input.source;
+			OptimisationInfo info;
+			if (verboseOptimisation)
+			{
+				std::cerr << "\n\n======= Optimization pass " << std::noshowpos << pass << " =======\n\n";
+			}
+			OptimizeLoopsByBenefit(input);
+			info = OptimizeProgram(input, output, 0, input.GetSize());
+			if (info.instructionDelta == 0)
+			{
+				return output;
+			}
+			else if (BudgetSpent())
+			{
+				if (verboseOptimisation)
+				{
+					std::cerr << "\nCompile budget spent after pass " << std::noshowpos << pass << ", loops left as they are: " << loopsSkipped << "\n";
+				}
+				return output;
+			}
+			else
+			{
+				return OptimizePasses(output, pass + 1);
+			}
+		}
+
+		// copies [begin, end) replacing loops of selected groups with Call, a loop at begin is copied if inlineFirst is set
+		void EmitWithCalls(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end, bool inlineFirst,
+			const std::vector<int>& groupOf, const std::vector<bool>& selected, std::vector<std::pair<TProgramCounter, int>>& calls)
+		{
+			std::vector<TProgramCounter> loopStack;
+			for (TProgramCounter i = begin; i < end; ++i)
+			{
+				InstructionDebug<TRegister> instruction = input.ReadDebug(i);
+				if (instruction.type == InstructionType::Jz)
+				{
+					int group = groupOf[i];
+					if (group >= 0 && selected[group] && !(i == begin && inlineFirst))
+					{
+						// the call keeps the source range of the loop it replaces
+						InstructionDebug<TRegister> loopEnd = input.ReadDebug(i + instruction.value);
+						calls.push_back(std::make_pair(output.GetSize(), group));
+						output.Append(InstructionDebug<TRegister>(InstructionType::Call, 0, instruction.sourceBegin, loopEnd.sourceEnd, instruction.sourceLine, instruction.sourceColumn));
+						i += instruction.value;
+						continue;
+					}
+					loopStack.push_back(output.GetSize());
+				}
+				else if (instruction.type == InstructionType::Jnz)
+				{
+					TProgramCounter loopBegin = loopStack.back();
+					loopStack.pop_back();
+					InstructionDebug<TRegister> jz = output.ReadDebug(loopBegin);
+					jz.value = output.GetSize() - loopBegin;
+					output.Replace(loopBegin, jz);
+					instruction.value = loopBegin - output.GetSize();
+				}
+				output.Append(instruction);
+			}
+		}
+
 	public:
 
 		// compiles bf source code to bytecode representation, collpases consecutive instructions
@@ -479,31 +854,202 @@ namespace sikfck {
 		{
 			auto ptr = std::make_unique<TOpt>();
 			ptr->verbose = this->verboseOptimisation;
+			loopPatternStates.push_back(loopPatterns.Add(ptr->Pattern()));
 			loopOptimizations.push_back(std::move(ptr));
 		}
 
-		Program<TRegister, TProgramCounter> Optimize(const Program<TRegister, TProgramCounter>& input, size_t pass = 0)
+		// Optimizes to a fixed point within the compile budget, what is done depends on optimizationLevel.
+		Program<TRegister, TProgramCounter> Optimize(const Program<TRegister, TProgramCounter>& input)
+		{
+			if (optimizationLevel == 0)
+			{
+				return input;
+			}
+			deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(compileTimeBudget);
+			instructionsSpent = 0;
+			loopsSkipped = 0;
+			if (optimizationLevel >= 3)
+			{
+				Program<TRegister, TProgramCounter> tracked;
+				tracked.debug = input.debug;
+				tracked.source = input.source;
+				PropagateKnownZero(input, tracked, 0, input.GetSize());
+				return OptimizePasses(tracked, 0);
+			}
+			return OptimizePasses(input, 0);
+		}
+
+		// loops of the last pass that were copied without trying the loop optimizations, because of the level or the budget
+		size_t GetSkippedLoopCount() const
+		{
+			return loopsSkipped;
+		}
+
+		// Expensive optimization for a single hot loop, [begin, end) must span from Jz to the matching Jnz.
+		// Tracks which cells are known to be zero to remove dead loops and turn additions into sets,
+		// then optimizes the loop to a fixed point. The result is a standalone program containing only the loop.
+		Program<TRegister, TProgramCounter> OptimizeHotLoop(const Program<TRegister, TProgramCounter>& input, TProgramCounter begin, TProgramCounter end)
+		{
+			Program<TRegister, TProgramCounter> tracked;
+			tracked.debug = input.debug;
+			tracked.source = input.source;
+			PropagateKnownZero(input, tracked, begin, end);
+			return Optimize(tracked);
+		}
+
+		// loops shorter than this are not worth a call
+		TProgramCounter minSubroutineLength = 6;
+
+		// Shares loops that occur several times: every occurrence becomes a Call to one copy placed after the program,
+		// which then ends with Ret. Loops only hold relative offsets, so equal instructions behave the same wherever
+		// the pointer is. Longer loops are shared first, occurrences inside a loop that is replaced by a call do not count.
+		// Calls and shared copies keep the source positions of the loops they stand for. Run it after Optimize.
+		Program<TRegister, TProgramCounter> Deduplicate(const Program<TRegister, TProgramCounter>& input)
 		{
+			TProgramCounter size = input.GetSize();
+
+			// group equal loops by hash, then by comparing the instructions
+			std::vector<int> groupOf(size, -1);
+			std::vector<std::vector<TProgramCounter>> groups;
+			std::unordered_map<uint64_t, std::vector<int>> byHash;
+			for (TProgramCounter i = 0; i < size; ++i)
+			{
+				if (input.itype[i] != InstructionType::Jz)
+				{
+					continue;
+				}
+				TProgramCounter length = input.ivalue[i] + 1;
+				uint64_t hash = 14695981039346656037ull;
+				for (TProgramCounter j = i; j < i + length; ++j)
+				{
+					hash = (hash ^ static_cast<uint64_t>(input.itype[j])) * 1099511628211ull;
+					hash = (hash ^ static_cast<uint64_t>(static_cast<int64_t>(input.ivalue[j]))) * 1099511628211ull;
+				}
+				std::vector<int>& candidates = byHash[hash];
+				for (int group : candidates)
+				{
+					TProgramCounter other = groups[group][0];
+					if (input.ivalue[other] + 1 == length
+						&& std::equal(input.itype.begin() + i, input.itype.begin() + i + length, input.itype.begin() + other)
+						&& std::equal(input.ivalue.begin() + i, input.ivalue.begin() + i + length, input.ivalue.begin() + other))
+					{
+						groupOf[i] = group;
+						break;
+					}
+				}
+				if (groupOf[i] < 0)
+				{
+					groupOf[i] = static_cast<int>(groups.size());
+					candidates.push_back(groupOf[i]);
+					groups.push_back(std::vector<TProgramCounter>());
+				}
+				groups[groupOf[i]].push_back(i);
+			}
+
+			std::vector<int> order(groups.size());
+			for (size_t g = 0; g < groups.size(); g++)
+			{
+				order[g] = static_cast<int>(g);
+			}
+			auto lengthOf = [&](int group) { return input.ivalue[groups[group][0]] + 1; };
+			std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return lengthOf(a) > lengthOf(b); });
+
+			// the interior of an occurrence replaced by a call is dead, only the shared copy stays
+			std::vector<bool> dead(size, false);
+			std::vector<bool> selected(groups.size(), false);
+			std::vector<TProgramCounter> shared(groups.size(), 0);
+			for (int group : order)
+			{
+				std::vector<TProgramCounter> live;
+				for (TProgramCounter at : groups[group])
+				{
+					if (!dead[at])
+					{
+						live.push_back(at);
+					}
+				}
+				TProgramCounter length = lengthOf(group);
+				TProgramCounter count = static_cast<TProgramCounter>(live.size());
+				if (length < minSubroutineLength || count < 2 || count * length <= count + length + 1)
+				{
+					continue;
+				}
+				selected[group] = true;
+				shared[group] = live[0];
+				for (size_t k = 1; k < live.size(); k++)
+				{
+					std::fill(dead.begin() + live[k] + 1, dead.begin() + live[k] + length, true);
+				}
+			}
+
+			// nesting of calls, shortest first so inner groups are known; too deep groups stay inline
+			std::vector<unsigned> height(groups.size(), 0);
+			for (auto it = order.rbegin(); it != order.rend(); ++it)
+			{
+				int group = *it;
+				if (!selected[group])
+				{
+					continue;
+				}
+				unsigned inner = 0;
+				TProgramCounter begin = shared[group];
+				for (TProgramCounter j = begin + 1; j < begin + lengthOf(group) - 1; ++j)
+				{
+					if (input.itype[j] == InstructionType::Jz && selected[groupOf[j]])
+					{
+						inner = std::max(inner, height[groupOf[j]]);
+						j += input.ivalue[j];
+					}
+				}
+				height[group] = inner + 1;
+				selected[group] = height[group] <= maxCallDepth;
+			}
+
 			Program<TRegister, TProgramCounter> output;
 			output.debug = input.debug;
 			output.source = input.source;
-			OptimisationInfo info;
-			if (verboseOptimisation)
+			std::vector<std::pair<TProgramCounter, int>> calls;
+			EmitWithCalls(input, output, 0, size, false, groupOf, selected, calls);
+			if (calls.empty())
 			{
-				std::cerr << "\n\n======= Optimization pass " << std::noshowpos << pass << " =======\n\n";
+				return output;
 			}
-			info = OptimizeProgram(input, output, 0, input.GetSize());
-			if (info.instructionDelta == 0)
+			InstructionDebug<TRegister> end = input.ReadDebug(size - 1);
+			output.Append(InstructionDebug<TRegister>(InstructionType::Ret, 0, end.sourceEnd, end.sourceEnd, end.sourceLine, end.sourceColumn));
+
+			// shared copies may contain calls themselves, calls grows while they are emitted
+			std::vector<TProgramCounter> entry(groups.size(), 0);
+			std::vector<bool> emitted(groups.size(), false);
+			for (size_t k = 0; k < calls.size(); k++)
 			{
-				return output;
+				int group = calls[k].second;
+				if (emitted[group])
+				{
+					continue;
+				}
+				emitted[group] = true;
+				entry[group] = output.GetSize();
+				EmitWithCalls(input, output, shared[group], shared[group] + lengthOf(group), true, groupOf, selected, calls);
+				InstructionDebug<TRegister> loopEnd = input.ReadDebug(shared[group] + lengthOf(group) - 1);
+				output.Append(InstructionDebug<TRegister>(InstructionType::Ret, 0, loopEnd.sourceEnd, loopEnd.sourceEnd, loopEnd.sourceLine, loopEnd.sourceColumn));
 			}
-			else
+			for (auto& call : calls)
 			{
-				return Optimize(output, pass + 1);
+				InstructionDebug<TRegister> instruction = output.ReadDebug(call.first);
+				instruction.value = entry[call.second] - call.first;
+				output.Replace(call.first, instruction);
 			}
-
+			return output;
 		}
 
+		// 0: none, 1: flat code only, 2: loop optimizations too, 3: also known zero tracking over the whole program.
+		// Deduplicate and tiered execution are separate steps, main enables them at level 3.
+		unsigned optimizationLevel = 2;
+
+		// limits for one Optimize call, 0 for no limit; instructions count the loop bodies the loop optimizations may look at, each nested loop once
+		unsigned compileTimeBudget = 0; // milliseconds
+		size_t compileInstructionBudget = 0;
+
 		bool verboseOptimisation = false;
 	};
 
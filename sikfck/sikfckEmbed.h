@@ -0,0 +1,214 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include "sikfck.h"
+#include "sikfckCompiler.h"
+#include "sikfckLoopOptimizations.h"
+
+namespace sikfck {
+
+	// In-process API for embedding the interpreter.
+	// A Script is compiled once and can be shared between threads, a Session owns the tape and runs
+	// scripts against caller supplied buffers or callbacks. Running does not allocate and does not throw.
+	namespace Embed {
+
+		// I/O on caller owned buffers, output beyond the capacity is dropped and counted
+		class SpanIo {
+		public:
+			const unsigned char* input;
+			size_t inputSize;
+			size_t consumed;
+			unsigned char* output;
+			size_t outputCapacity;
+			size_t produced;
+			size_t dropped;
+
+			SpanIo(const unsigned char* input, size_t inputSize, unsigned char* output, size_t outputCapacity)
+				: input(input),
+				inputSize(inputSize),
+				consumed(0),
+				output(output),
+				outputCapacity(outputCapacity),
+				produced(0),
+				dropped(0) {}
+
+			int Read() {
+				return consumed < inputSize ? input[consumed++] : EOF;
+			}
+
+			void Write(int value) {
+				if (produced < outputCapacity) {
+					output[produced++] = static_cast<unsigned char>(value);
+				}
+				else {
+					++dropped;
+				}
+			}
+		};
+
+		// I/O through plain function pointers, read returns a byte or EOF
+		class CallbackIo {
+		public:
+			int(*read)(void* context);
+			void(*write)(void* context, unsigned char value);
+			void* context;
+			size_t consumed;
+			size_t produced;
+
+			CallbackIo(int(*read)(void* context), void(*write)(void* context, unsigned char value), void* context)
+				: read(read),
+				write(write),
+				context(context),
+				consumed(0),
+				produced(0) {}
+
+			int Read() {
+				int value = read(context);
+				if (value != EOF) {
+					++consumed;
+				}
+				return value;
+			}
+
+			void Write(int value) {
+				write(context, static_cast<unsigned char>(value));
+				++produced;
+			}
+		};
+
+		enum class Status {
+			Ok,
+			OutputTruncated, // the program produced more output than the output buffer holds, it was stopped
+			InvalidScript, // the script failed to compile or contains an illegal instruction
+			StepLimitExceeded, // the program ran more instructions than Session::stepLimit allows
+			Cancelled // Session::cancel was set while the program ran
+		};
+
+		struct Report {
+			Status status;
+			size_t consumed; // bytes read from input
+			size_t produced; // bytes written to output
+		};
+
+		class Script {
+			std::shared_ptr<const LinkedProgram<int, int>> program;
+			std::string error;
+
+		public:
+			static Script Compile(const std::string& source) {
+				Script script;
+				try {
+					Compiler<int, int> compiler;
+					compiler.UseLoopOptimization<LoopOptimizations::SetToZero<int, int>>();
+					compiler.UseLoopOptimization<LoopOptimizations::LinearArithmetic<int, int>>();
+					compiler.UseLoopOptimization<LoopOptimizations::ClearUntilZero<int, int>>();
+					compiler.UseLoopOptimization<LoopOptimizations::MoveUntilZero<int, int>>();
+					compiler.UseLoopOptimization<LoopOptimizations::RegisterPromotion<int, int>>();
+					script.program = std::make_shared<const LinkedProgram<int, int>>(compiler.Optimize(compiler.Compile(source)));
+				}
+				catch (const std::exception& e) {
+					script.error = e.what();
+				}
+				return script;
+			}
+
+			bool IsValid() const {
+				return program != nullptr;
+			}
+
+			const std::string& GetError() const {
+				return error;
+			}
+
+			friend class Session;
+		};
+
+		// Execution context, reuse it for many runs to avoid allocating a tape each time.
+		// A session must not be used by several threads at once, use one session per thread.
+		class Session {
+			Memory<int, int> memory;
+
+			// stops a run when its output was truncated or its steps are used up
+			template <typename TIo> class LimitMonitor {
+			public:
+				const TIo& io;
+				size_t remaining;
+
+				LimitMonitor(const TIo& io, size_t remaining)
+					: io(io),
+					remaining(remaining) {}
+
+				bool Step(int, InstructionType) {
+					if (remaining == 0 || Truncated(io)) {
+						return false;
+					}
+					--remaining;
+					return true;
+				}
+			};
+
+			static bool Truncated(const SpanIo& io) {
+				return io.dropped > 0;
+			}
+
+			static bool Truncated(const CallbackIo&) {
+				return false;
+			}
+
+			template <typename TIo> Status Execute(const Script& script, TIo& io) {
+				if (!script.IsValid()) {
+					return Status::InvalidScript;
+				}
+				memory.Clear(0, Memory<int, int>::size);
+				Cpu<int, int, int> cpu;
+				cpu.suspendRequest = cancel;
+				LimitMonitor<TIo> monitor(io, stepLimit > 0 ? stepLimit : SIZE_MAX);
+				ExecutionResult result;
+				try {
+					result = cpu.Run(*script.program, memory, io, monitor);
+				}
+				catch (const std::exception&) {
+					return Status::InvalidScript;
+				}
+				if (result == ExecutionResult::Suspended) {
+					return Status::Cancelled;
+				}
+				if (result == ExecutionResult::Interrupted) {
+					return Truncated(io) ? Status::OutputTruncated : Status::StepLimitExceeded;
+				}
+				return Status::Ok;
+			}
+
+		public:
+			// limits for every run: at most stepLimit executed instructions, 0 for no limit,
+			// and a flag another thread may set to stop the run at its next loop iteration
+			size_t stepLimit = 0;
+			const std::atomic<bool>* cancel = nullptr;
+
+			Report Run(const Script& script, const unsigned char* input, size_t inputSize, unsigned char* output, size_t outputCapacity) {
+				SpanIo io(input, inputSize, output, outputCapacity);
+				Report report;
+				report.status = Execute(script, io);
+				if (report.status == Status::Ok && io.dropped > 0) {
+					report.status = Status::OutputTruncated;
+				}
+				report.consumed = io.consumed;
+				report.produced = io.produced;
+				return report;
+			}
+
+			Report Run(const Script& script, CallbackIo io) {
+				Report report;
+				report.status = Execute(script, io);
+				report.consumed = io.consumed;
+				report.produced = io.produced;
+				return report;
+			}
+		};
+
+	}
+}
@@ -1,6 +1,5 @@
 #pragma once
 #include "sikfckCompiler.h"
-#include <map>
 
 namespace sikfck {
 
@@ -9,25 +8,24 @@ namespace sikfck {
 		template <typename TRegister, typename TProgramCounter> class SetToZero : public LoopOptimization<TRegister, TProgramCounter>
 		{
 		public:
-			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
+			LoopPattern Pattern() const override
 			{
-				TProgramCounter outerInstructionCount = end - begin;
+				return LoopPattern().Then({ InstructionType::Add });
+			}
 
-				if (outerInstructionCount == 3)
+			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
+			{
+				if (end - begin != 3 || input.itype[begin + 1] != InstructionType::Add)
+				{
+					return false;
+				}
+				if (input.ivalue[begin + 1] == +1 || input.ivalue[begin + 1] == -1)
 				{
 					InstructionDebug<TRegister> a = input.ReadDebug(begin);
-					InstructionDebug<TRegister> b = input.ReadDebug(begin + 1);
 					InstructionDebug<TRegister> c = input.ReadDebug(begin + 2);
-					if (a.type == InstructionType::Jz && c.type == InstructionType::Jnz)
-					{
-						if (b.type == InstructionType::Add && (b.value == +1 || b.value == -1))
-						{
-							InstructionDebug<TRegister> replacement(InstructionType::Set, 0, a.sourceBegin, c.sourceEnd, a.sourceLine, a.sourceColumn);
-							output.Append(replacement);
-							return true;
-						}
-						return false;
-					}
+					InstructionDebug<TRegister> replacement(InstructionType::Set, 0, a.sourceBegin, c.sourceEnd, a.sourceLine, a.sourceColumn);
+					output.Append(replacement);
+					return true;
 				}
 				return false;
 			}
@@ -36,31 +34,73 @@ namespace sikfck {
 
 		template <typename TRegister, typename TProgramCounter> class LinearArithmetic : public LoopOptimization<TRegister, TProgramCounter>
 		{
+			// distinct cells a body may touch, the scratch space lives on the stack
+			static const unsigned maxCells = 32;
+
+			// adds value to the cell at offset, offsets are kept sorted, false if there are too many cells
+			static bool Accumulate(int* offsets, int* operators, unsigned& cells, int offset, int value)
+			{
+				unsigned i = 0;
+				while (i < cells && offsets[i] < offset)
+				{
+					i++;
+				}
+				if (i == cells || offsets[i] != offset)
+				{
+					if (cells == maxCells)
+					{
+						return false;
+					}
+					for (unsigned j = cells; j > i; j--)
+					{
+						offsets[j] = offsets[j - 1];
+						operators[j] = operators[j - 1];
+					}
+					offsets[i] = offset;
+					operators[i] = 0;
+					cells++;
+				}
+				operators[i] += value;
+				return true;
+			}
 
 		public:
+			LoopPattern Pattern() const override
+			{
+				return LoopPattern().ThenRepeated({ InstructionType::Add, InstructionType::AddPi, InstructionType::AddPd, InstructionType::PtrAdd });
+			}
+
 			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
 			{
 				TProgramCounter innerBegin = begin + 1;
 				TProgramCounter innerEnd = end - 1;
 				
-				std::map<int, int> operators;
+				int offsets[maxCells];
+				int operators[maxCells];
+				unsigned cells = 0;
 				int offset = 0;
 				for (TProgramCounter i= innerBegin; i<innerEnd; ++i) {
-					InstructionDebug<TRegister> instruction = input.ReadDebug(i);
-					switch (instruction.type) {
+					int value = static_cast<int>(input.ivalue[i]);
+					switch (input.itype[i]) {
 						case InstructionType::Add:
-							operators[offset] += instruction.value;
+							if (!Accumulate(offsets, operators, cells, offset, value)) {
+								return false;
+							}
 							break;
 						case InstructionType::AddPd:
-							operators[offset] += instruction.value;
+							if (!Accumulate(offsets, operators, cells, offset, value)) {
+								return false;
+							}
 							offset -= 1;
 							break;
 						case InstructionType::AddPi:
-							operators[offset] += instruction.value;
+							if (!Accumulate(offsets, operators, cells, offset, value)) {
+								return false;
+							}
 							offset += 1;
 							break;
 						case InstructionType::PtrAdd:
-							offset += instruction.value;
+							offset += value;
 							break;
 						default:
 							// cannot optimised this
@@ -75,42 +115,47 @@ namespace sikfck {
 				}
 
 				// the control variable must be in decrement mode
-				if (operators[0] != -1) {
+				unsigned control = 0;
+				while (control < cells && offsets[control] != 0) {
+					control++;
+				}
+				if (control == cells || operators[control] != -1) {
 					return false;
 				}
 
 				// success, can be reduced
 				InstructionDebug<TRegister> loopBegin = input.ReadDebug(begin);
-				InstructionDebug<TRegister> loopEnd = input.ReadDebug(begin + 2);
+				InstructionDebug<TRegister> loopEnd = input.ReadDebug(end - 1);
 				InstructionDebug<TRegister> temp(InstructionType::Nop, 0, loopBegin.sourceBegin, loopEnd.sourceEnd, loopBegin.sourceLine, loopBegin.sourceColumn);
 
 				int power = 1;
 				bool done = false;
 				while (!done) {
 					done = true;
-					for (auto& op : operators) {
-						if (op.first == 0) {
+					for (unsigned k = 0; k < cells; k++) {
+						if (k == control) {
 							continue;
 						}
-						if (op.second == 0) {
+						int& op = operators[k];
+						if (op == 0) {
 							// no need to do anyting here
 						}
 						else {
-							if (op.second > 0 && ((power&op.second)>0)) {
+							if (op > 0 && ((power&op)>0)) {
 								temp.type = InstructionType::AddM;
-								temp.value = op.first; // ofset
+								temp.value = offsets[k]; // ofset
 								output.Append(temp);
-								op.second -= power; // clear
-								if (op.second != 0) {
+								op -= power; // clear
+								if (op != 0) {
 									done = false;
 								}
 							}
-							else if (op.second<0 && ((power&(-op.second))>0)) {
+							else if (op<0 && ((power&(-op))>0)) {
 								temp.type = InstructionType::SubM;
-								temp.value = op.first; // ofset
+								temp.value = offsets[k]; // ofset
 								output.Append(temp);
-								op.second += power;
-								if (op.second != 0) {
+								op += power;
+								if (op != 0) {
 									done = false;
 								}
 							}
@@ -131,12 +176,228 @@ namespace sikfck {
 
 				temp.type = InstructionType::Set;
 				temp.value = 0;
-				operators[0] = 0;
 				output.Append(temp);
 
 				return true;
 			}
 		};
 
+
+		// [[-]>] clears cells until a zero cell is found
+		template <typename TRegister, typename TProgramCounter> class ClearUntilZero : public LoopOptimization<TRegister, TProgramCounter>
+		{
+		public:
+			LoopPattern Pattern() const override
+			{
+				return LoopPattern().Then({ InstructionType::Set }).Then({ InstructionType::PtrAdd });
+			}
+
+			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
+			{
+				if (end - begin != 4)
+				{
+					return false;
+				}
+				if (input.itype[begin + 1] != InstructionType::Set || input.ivalue[begin + 1] != 0 || input.itype[begin + 2] != InstructionType::PtrAdd || input.ivalue[begin + 2] == 0)
+				{
+					return false;
+				}
+				InstructionDebug<TRegister> loopBegin = input.ReadDebug(begin);
+				InstructionDebug<TRegister> loopEnd = input.ReadDebug(end - 1);
+				InstructionDebug<TRegister> replacement(InstructionType::ClearScan, input.ivalue[begin + 2], loopBegin.sourceBegin, loopEnd.sourceEnd, loopBegin.sourceLine, loopBegin.sourceColumn);
+				output.Append(replacement);
+				return true;
+			}
+		};
+
+
+		// [[->+<]<] moves (or copies to several targets) a block of cells until a zero cell is found,
+		// matched after the inner loop was reduced to AddM/SubM and Set 0 by LinearArithmetic
+		template <typename TRegister, typename TProgramCounter> class MoveUntilZero : public LoopOptimization<TRegister, TProgramCounter>
+		{
+		public:
+			LoopPattern Pattern() const override
+			{
+				return LoopPattern().ThenRepeated({ InstructionType::AddM, InstructionType::SubM }).Then({ InstructionType::Set }).Then({ InstructionType::PtrAdd });
+			}
+
+			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
+			{
+				TProgramCounter innerBegin = begin + 1;
+				TProgramCounter innerEnd = end - 1;
+				if (innerEnd - innerBegin < 3)
+				{
+					return false;
+				}
+				TProgramCounter targetsEnd = innerEnd - 2;
+				for (TProgramCounter i = innerBegin; i < targetsEnd; ++i)
+				{
+					if ((input.itype[i] != InstructionType::AddM && input.itype[i] != InstructionType::SubM) || input.ivalue[i] == 0)
+					{
+						return false;
+					}
+				}
+				if (input.itype[targetsEnd] != InstructionType::Set || input.ivalue[targetsEnd] != 0)
+				{
+					return false;
+				}
+				if (input.itype[targetsEnd + 1] != InstructionType::PtrAdd || input.ivalue[targetsEnd + 1] == 0)
+				{
+					return false;
+				}
+
+				InstructionDebug<TRegister> loopBegin = input.ReadDebug(begin);
+				InstructionDebug<TRegister> loopEnd = input.ReadDebug(end - 1);
+				InstructionDebug<TRegister> word(InstructionType::MoveScan, 1 + 2 * (targetsEnd - innerBegin), loopBegin.sourceBegin, loopEnd.sourceEnd, loopBegin.sourceLine, loopBegin.sourceColumn);
+				output.Append(word);
+				word.type = InstructionType::Data;
+				word.value = input.ivalue[targetsEnd + 1];
+				output.Append(word);
+				for (TProgramCounter i = innerBegin; i < targetsEnd; ++i)
+				{
+					word.value = input.ivalue[i];
+					output.Append(word);
+					word.value = input.itype[i] == InstructionType::AddM ? 1 : -1;
+					output.Append(word);
+				}
+				return true;
+			}
+		};
+
+
+		// Loops bouncing between a few neighbouring cells, like [>+<--] or [>.<-], keep those cells in the Cpu register file.
+		// RegLoad before the loop loads the cells, pointer moves in the body become RegSelect and RegStore writes the cells back at exit.
+		// Register 0 is the cell at offset 0, it is selected whenever Jz or Jnz tests the current value.
+		template <typename TRegister, typename TProgramCounter> class RegisterPromotion : public LoopOptimization<TRegister, TProgramCounter>
+		{
+		public:
+			static const unsigned maxRegisters = 4;
+
+			LoopPattern Pattern() const override
+			{
+				return LoopPattern().ThenRepeated({ InstructionType::Add, InstructionType::AddPi, InstructionType::AddPd, InstructionType::PtrAdd, InstructionType::Set, InstructionType::In, InstructionType::Out });
+			}
+
+			bool TryPerform(const Program<TRegister, TProgramCounter>& input, Program<TRegister, TProgramCounter>& output, TProgramCounter begin, TProgramCounter end) override
+			{
+				TProgramCounter innerBegin = begin + 1;
+				TProgramCounter innerEnd = end - 1;
+				int offsets[maxRegisters] = { 0 };
+				unsigned count = 1;
+				bool io = false;
+				int offset = 0;
+				for (TProgramCounter i = innerBegin; i < innerEnd; ++i)
+				{
+					InstructionType type = input.itype[i];
+					if (type == InstructionType::PtrAdd)
+					{
+						offset += static_cast<int>(input.ivalue[i]);
+						continue;
+					}
+					if (type == InstructionType::In || type == InstructionType::Out)
+					{
+						io = true;
+					}
+					else if (type != InstructionType::Add && type != InstructionType::AddPi && type != InstructionType::AddPd && type != InstructionType::Set)
+					{
+						return false;
+					}
+					if (RegisterOf(offsets, count, offset) == count)
+					{
+						if (count == maxRegisters)
+						{
+							return false;
+						}
+						offsets[count++] = offset;
+					}
+					if (type == InstructionType::AddPi)
+					{
+						offset += 1;
+					}
+					else if (type == InstructionType::AddPd)
+					{
+						offset -= 1;
+					}
+				}
+
+				// a single cell gains nothing, without I/O OptimizeFlat folds three or more cells into one Block which is cheaper
+				if (offset != 0 || count < 2 || (!io && count >= 3))
+				{
+					return false;
+				}
+
+				InstructionDebug<TRegister> loopBegin = input.ReadDebug(begin);
+				InstructionDebug<TRegister> loopEnd = input.ReadDebug(end - 1);
+				AppendOffsets(output, InstructionType::RegLoad, loopBegin, offsets, count);
+				TProgramCounter jzIndex = output.GetSize();
+				output.Append(loopBegin);
+
+				unsigned selected = 0;
+				offset = 0;
+				for (TProgramCounter i = innerBegin; i < innerEnd; ++i)
+				{
+					InstructionDebug<TRegister> instruction = input.ReadDebug(i);
+					if (instruction.type == InstructionType::PtrAdd)
+					{
+						offset += static_cast<int>(instruction.value);
+						continue;
+					}
+					Select(output, instruction, selected, RegisterOf(offsets, count, offset));
+					if (instruction.type == InstructionType::AddPi || instruction.type == InstructionType::AddPd)
+					{
+						offset += instruction.type == InstructionType::AddPi ? 1 : -1;
+						instruction.type = InstructionType::Add;
+					}
+					output.Append(instruction);
+				}
+				Select(output, loopEnd, selected, 0);
+
+				TProgramCounter jnzIndex = output.GetSize();
+				loopBegin.value = jnzIndex - jzIndex;
+				output.Replace(jzIndex, loopBegin);
+				loopEnd.value = jzIndex - jnzIndex;
+				output.Append(loopEnd);
+				AppendOffsets(output, InstructionType::RegStore, loopEnd, offsets, count);
+				return true;
+			}
+
+		private:
+			static unsigned RegisterOf(const int* offsets, unsigned count, int offset)
+			{
+				for (unsigned k = 0; k < count; k++)
+				{
+					if (offsets[k] == offset)
+					{
+						return k;
+					}
+				}
+				return count;
+			}
+
+			static void Select(Program<TRegister, TProgramCounter>& output, InstructionDebug<TRegister> at, unsigned& selected, unsigned target)
+			{
+				if (selected != target)
+				{
+					at.type = InstructionType::RegSelect;
+					at.value = target;
+					output.Append(at);
+					selected = target;
+				}
+			}
+
+			static void AppendOffsets(Program<TRegister, TProgramCounter>& output, InstructionType type, InstructionDebug<TRegister> at, const int* offsets, unsigned count)
+			{
+				at.type = type;
+				at.value = count;
+				output.Append(at);
+				at.type = InstructionType::Data;
+				for (unsigned k = 0; k < count; k++)
+				{
+					at.value = offsets[k];
+					output.Append(at);
+				}
+			}
+		};
+
 	}
 }
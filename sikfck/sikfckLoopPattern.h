@@ -0,0 +1,115 @@
+#pragma once
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Declarative shape of the loop bodies a LoopOptimization applies to, a sequence of instruction type sets
+	// where each element matches one instruction or, if repeated, one or more. The Jz and Jnz around the body are implied.
+	// Patterns only look at instruction types, TryPerform still checks the values.
+	//
+	//     LoopPattern().Then({ InstructionType::Set }).Then({ InstructionType::PtrAdd })
+	class LoopPattern {
+	public:
+		static const unsigned maxElements = 8;
+
+		struct Element {
+			uint32_t types; // bit per InstructionType
+			bool repeated;
+		};
+
+		Element elements[maxElements];
+		unsigned size;
+		bool any; // matches every loop, the default for optimizations without a pattern
+
+		LoopPattern()
+			: size(0),
+			any(false) {}
+
+		static LoopPattern Any() {
+			LoopPattern pattern;
+			pattern.any = true;
+			return pattern;
+		}
+
+		LoopPattern& Then(std::initializer_list<InstructionType> types) {
+			return Append(types, false);
+		}
+
+		LoopPattern& ThenRepeated(std::initializer_list<InstructionType> types) {
+			return Append(types, true);
+		}
+
+	private:
+		LoopPattern& Append(std::initializer_list<InstructionType> types, bool repeated) {
+			if (size == maxElements) {
+				throw std::length_error("Loop pattern has too many elements.");
+			}
+			Element& element = elements[size++];
+			element.types = 0;
+			element.repeated = repeated;
+			for (InstructionType type : types) {
+				element.types |= 1u << static_cast<unsigned>(type);
+			}
+			return *this;
+		}
+	};
+
+	// The patterns of all registered loop optimizations merged into one shift-and automaton with a state bit per element.
+	// Run goes over a loop body once and returns the final states reached, so the compiler only calls TryPerform
+	// on optimizations whose pattern matched. Patterns that do not fit in the 64 states are treated as Any.
+	class LoopPatternAutomaton {
+		static const unsigned typeCount = static_cast<unsigned>(InstructionType::Data) + 1;
+		static_assert(typeCount <= 32, "instruction types must fit in the element type mask");
+
+		uint64_t accepts[typeCount]; // states entered by an instruction of the type
+		uint64_t first; // first state of each pattern, only entered by the first instruction of the body
+		uint64_t repeated; // states that stay active on another matching instruction
+		unsigned used;
+
+	public:
+		LoopPatternAutomaton()
+			: first(0),
+			repeated(0),
+			used(0) {
+			for (unsigned t = 0; t < typeCount; t++) {
+				accepts[t] = 0;
+			}
+		}
+
+		// returns the final state of the pattern, or -1 if it matches every loop
+		int Add(const LoopPattern& pattern) {
+			if (pattern.any || pattern.size == 0 || used + pattern.size > 64) {
+				return -1;
+			}
+			first |= 1ull << used;
+			for (unsigned e = 0; e < pattern.size; e++, used++) {
+				uint64_t state = 1ull << used;
+				for (unsigned t = 0; t < typeCount; t++) {
+					if (pattern.elements[e].types & (1u << t)) {
+						accepts[t] |= state;
+					}
+				}
+				if (pattern.elements[e].repeated) {
+					repeated |= state;
+				}
+			}
+			return static_cast<int>(used) - 1;
+		}
+
+		template <typename TRegister, typename TProgramCounter> uint64_t Run(const Program<TRegister, TProgramCounter>& input, TProgramCounter begin, TProgramCounter end) const {
+			if (begin >= end) {
+				return 0;
+			}
+			uint64_t active = first & accepts[static_cast<unsigned>(input.itype[begin])];
+			for (TProgramCounter i = begin + 1; i < end && active != 0; ++i) {
+				uint64_t next = ((active << 1) & ~first) | (active & repeated);
+				active = next & accepts[static_cast<unsigned>(input.itype[i])];
+			}
+			return active;
+		}
+	};
+
+}
@@ -0,0 +1,445 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Runs consecutive top level segments of a program concurrently when they work on separate parts of the tape.
+	// A segment is a top level loop or call of a shared loop together with the flat code before it. Its cells relative to the pointer at its start
+	// are bounded from pointer moves, instruction offsets and loops whose body returns to the same cell.
+	// Segments without I/O whose cells do not overlap form a batch, the segments of a batch run on their own threads
+	// against the shared Memory and join before the rest of the program continues.
+	// A segment without I/O that can not be bounded, because of scans or unbalanced loops, ends a batch and runs
+	// speculatively on a private copy of the tape while the cells it touches are tracked. It is stopped when the others are done,
+	// since cells they wrote may keep its loops from ending. If the cells it touched overlap the cells of an earlier segment
+	// in the batch its result is dropped and it runs again after the others, otherwise its cells are copied back and an
+	// unfinished run continues on the shared tape.
+	template <typename TRegister, typename TProgramCounter, typename TPointer> class ParallelExecutor {
+	public:
+		struct Segment {
+			TProgramCounter begin;
+			TProgramCounter end;
+			bool io;
+			bool bounded; // low, high and move are known
+			int low; // lowest and highest cell relative to the pointer at the start of the segment
+			int high;
+			int move; // pointer change over the whole segment
+		};
+
+		struct Batch {
+			TProgramCounter begin;
+			TProgramCounter end;
+			size_t first; // segments [first, last) run together
+			size_t last;
+		};
+
+	private:
+		// records the lowest and highest location accessed through it
+		class RangeMemory {
+		public:
+			Memory<TRegister, TPointer>& memory;
+			int64_t low;
+			int64_t high;
+			bool touched;
+
+			explicit RangeMemory(Memory<TRegister, TPointer>& memory)
+				: memory(memory),
+				low(0),
+				high(0),
+				touched(false) {}
+
+			void Touch(TPointer first, TPointer last) {
+				int64_t a = std::min<int64_t>(first, last);
+				int64_t b = std::max<int64_t>(first, last);
+				low = touched ? std::min(low, a) : a;
+				high = touched ? std::max(high, b) : b;
+				touched = true;
+			}
+
+			void Write(TPointer pointer, TRegister value) {
+				Touch(pointer, pointer);
+				memory.Write(pointer, value);
+			}
+
+			TRegister Read(TPointer pointer) {
+				Touch(pointer, pointer);
+				return memory.Read(pointer);
+			}
+
+			void AddBlock(TPointer location, const TRegister* delta, const TRegister* keep, unsigned width) {
+				Touch(location, location + width - 1);
+				memory.AddBlock(location, delta, keep, width);
+			}
+
+			void Clear(TPointer location, unsigned width) {
+				Touch(location, location + width - 1);
+				memory.Clear(location, width);
+			}
+
+			TPointer ClearUntilZero(TPointer location, TPointer stride) {
+				TPointer end = memory.ClearUntilZero(location, stride);
+				Touch(location, end);
+				return end;
+			}
+
+			TPointer MoveUntilZero(TPointer location, TPointer stride, const TRegister* targets, unsigned count) {
+				TPointer end = memory.MoveUntilZero(location, stride, targets, count);
+				Touch(location, end);
+				for (unsigned i = 0; i < count; i++) {
+					Touch(location + targets[2 * i], end + targets[2 * i]);
+				}
+				return end;
+			}
+		};
+
+		// stops a Cpu when it reaches the end of its segment or stop is raised
+		class SegmentMonitor {
+		public:
+			TProgramCounter end;
+			const std::atomic<bool>* stop;
+
+			bool Step(TProgramCounter programCounter, InstructionType) {
+				return programCounter != end && (stop == nullptr || !stop->load(std::memory_order_relaxed));
+			}
+		};
+
+		// stops the main Cpu at the start of a batch
+		class BatchMonitor {
+		public:
+			std::vector<int> batchAt; // per instruction the batch starting there, -1 if none
+
+			bool Step(TProgramCounter programCounter, InstructionType) {
+				return batchAt[programCounter] < 0;
+			}
+		};
+
+		// I/O object for segments proven not to do I/O
+		class NoIo {
+		public:
+			int Read() {
+				return EOF;
+			}
+
+			void Write(int) {}
+		};
+
+		LinkedProgram<TRegister, TProgramCounter> linked;
+		std::vector<Segment> segments;
+		std::vector<Batch> batches;
+		BatchMonitor monitor;
+		size_t reexecuted;
+
+		static void Touch(int offset, int& low, int& high) {
+			low = std::min(low, offset);
+			high = std::max(high, offset);
+		}
+
+		// walks [begin, end) and widens [low, high] by the cells accessed, false if they can not be bounded
+		static bool Analyze(const Program<TRegister, TProgramCounter>& program, TProgramCounter begin, TProgramCounter end, int& offset, int& low, int& high) {
+			for (TProgramCounter i = begin; i < end; ++i) {
+				int value = static_cast<int>(program.ivalue[i]);
+				switch (program.itype[i]) {
+				case InstructionType::AddM:
+				case InstructionType::SubM:
+				case InstructionType::MulM:
+					Touch(offset + value, low, high);
+					break;
+				case InstructionType::AddPi:
+				case InstructionType::AddPd:
+				case InstructionType::PtrAdd:
+					offset += program.itype[i] == InstructionType::AddPi ? 1 : program.itype[i] == InstructionType::AddPd ? -1 : value;
+					Touch(offset, low, high);
+					break;
+				case InstructionType::Block:
+				case InstructionType::Clear:
+					Touch(offset + static_cast<int>(program.ivalue[i + 1]), low, high);
+					Touch(offset + static_cast<int>(program.ivalue[i + 1] + program.ivalue[i + 2]) - 1, low, high);
+					offset += static_cast<int>(program.ivalue[i + 3]);
+					Touch(offset, low, high);
+					i += value;
+					break;
+				case InstructionType::RegLoad:
+				case InstructionType::RegStore:
+					for (int k = 1; k <= value; k++) {
+						Touch(offset + static_cast<int>(program.ivalue[i + k]), low, high);
+					}
+					i += value;
+					break;
+				case InstructionType::Jz:
+				case InstructionType::Call:
+					{
+						// the body must return to the cell it started on, then every iteration accesses the same cells,
+						// a call runs a shared loop placed after the program
+						int bodyOffset = offset;
+						TProgramCounter loopBegin = i + (program.itype[i] == InstructionType::Call ? value : 0);
+						TProgramCounter loopEnd = loopBegin + program.ivalue[loopBegin];
+						if (!Analyze(program, loopBegin + 1, loopEnd, bodyOffset, low, high) || bodyOffset != offset) {
+							return false;
+						}
+						if (program.itype[i] == InstructionType::Jz) {
+							i = loopEnd;
+						}
+					}
+					break;
+				case InstructionType::ClearScan:
+				case InstructionType::MoveScan:
+					return false;
+				default:
+					// current cell only
+					break;
+				}
+			}
+			return true;
+		}
+
+		// whether [begin, end) or a loop it calls does I/O
+		static bool UsesIo(const Program<TRegister, TProgramCounter>& program, TProgramCounter begin, TProgramCounter end) {
+			for (TProgramCounter i = begin; i < end; ++i) {
+				InstructionType type = program.itype[i];
+				if (type == InstructionType::In || type == InstructionType::Out) {
+					return true;
+				}
+				if (type == InstructionType::Call) {
+					TProgramCounter target = i + program.ivalue[i];
+					if (UsesIo(program, target, target + program.ivalue[target] + 1)) {
+						return true;
+					}
+				}
+			}
+			return false;
+		}
+
+		static bool Overlap(int64_t aLow, int64_t aHigh, int64_t bLow, int64_t bHigh) {
+			const int64_t size = Memory<TRegister, TPointer>::size;
+			if (aHigh - aLow + 1 >= size || bHigh - bLow + 1 >= size) {
+				return true;
+			}
+			// compare on the circular tape
+			int64_t shift = ((aLow % size) + size) % size - aLow;
+			aLow += shift;
+			aHigh += shift;
+			shift = ((bLow % size) + size) % size - bLow;
+			bLow += shift;
+			bHigh += shift;
+			for (int64_t wrap = -size; wrap <= size; wrap += size) {
+				if (aLow <= bHigh + wrap && bLow + wrap <= aHigh) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void Split(const Program<TRegister, TProgramCounter>& program) {
+			// a top level Ret ends the program, the loops shared by Compiler::Deduplicate follow it
+			TProgramCounter size = 0;
+			while (size < program.GetSize() && program.itype[size] != InstructionType::Ret) {
+				InstructionType type = program.itype[size];
+				if (type == InstructionType::Jz || type == InstructionType::Block || type == InstructionType::Clear || type == InstructionType::MoveScan || type == InstructionType::RegLoad || type == InstructionType::RegStore) {
+					size += program.ivalue[size];
+				}
+				++size;
+			}
+			TProgramCounter begin = 0;
+			TProgramCounter i = 0;
+			while (i < size) {
+				InstructionType type = program.itype[i];
+				if (type == InstructionType::Jz || type == InstructionType::Block || type == InstructionType::Clear || type == InstructionType::MoveScan || type == InstructionType::RegLoad || type == InstructionType::RegStore) {
+					// skip to the matching Jnz or over the data words
+					i += program.ivalue[i];
+				}
+				++i;
+				// a loop promoted to registers ends with its RegStore
+				bool loopEnd = (type == InstructionType::Jz && !(i < size && program.itype[i] == InstructionType::RegStore)) || type == InstructionType::Call;
+				if (loopEnd || type == InstructionType::RegStore || i == size) {
+					Segment segment;
+					segment.begin = begin;
+					segment.end = i;
+					segment.io = UsesIo(program, begin, i);
+					// the cell at the start is only accessed if the segment does not begin by moving away
+					bool leadingMove = program.itype[begin] == InstructionType::PtrAdd;
+					segment.low = leadingMove ? std::numeric_limits<int>::max() : 0;
+					segment.high = leadingMove ? std::numeric_limits<int>::min() : 0;
+					segment.move = 0;
+					segment.bounded = Analyze(program, begin, i, segment.move, segment.low, segment.high);
+					segments.push_back(segment);
+					begin = i;
+				}
+			}
+		}
+
+		void Plan(unsigned threads) {
+			size_t i = 0;
+			while (i < segments.size()) {
+				size_t first = i;
+				std::vector<int> entry; // pointer of each member relative to the start of the batch
+				int pointer = 0;
+				while (i < segments.size() && !segments[i].io && i - first < threads) {
+					const Segment& segment = segments[i];
+					bool overlaps = false;
+					if (segment.bounded) {
+						for (size_t k = first; k < i; k++) {
+							overlaps = overlaps || Overlap(entry[k - first] + segments[k].low, entry[k - first] + segments[k].high, pointer + segment.low, pointer + segment.high);
+						}
+					}
+					if (overlaps) {
+						break;
+					}
+					entry.push_back(pointer);
+					pointer += segment.move;
+					i++;
+					if (!segment.bounded) {
+						break;
+					}
+				}
+				if (i - first >= 2) {
+					Batch batch;
+					batch.begin = segments[first].begin;
+					batch.end = segments[i - 1].end;
+					batch.first = first;
+					batch.last = i;
+					monitor.batchAt[batch.begin] = static_cast<int>(batches.size());
+					batches.push_back(batch);
+				}
+				else if (i == first) {
+					i++;
+				}
+			}
+		}
+
+		// runs segment until its end or until stop is raised, the cpu is not flushed
+		template <typename TMemory> void StartSegment(Cpu<TRegister, TProgramCounter, TPointer>& cpu, const Segment& segment, TMemory& memory, TPointer entry, const std::atomic<bool>* stop) {
+			NoIo io;
+			SegmentMonitor end;
+			end.end = segment.end;
+			end.stop = stop;
+			TProgramCounter start = segment.begin;
+			if (static_cast<InstructionType>(linked.code[start].type) == InstructionType::PtrAdd) {
+				// apply a leading pointer move directly, the cell at the entry may belong to another segment
+				entry += linked.code[start].value;
+				start++;
+			}
+			cpu.Resume(memory, start, entry);
+			cpu.Run(linked, memory, io, end);
+		}
+
+		template <typename TMemory> void RunSegment(const Segment& segment, TMemory& memory, TPointer entry, TPointer& exit) {
+			Cpu<TRegister, TProgramCounter, TPointer> cpu;
+			StartSegment(cpu, segment, memory, entry, nullptr);
+			cpu.Flush(memory);
+			exit = cpu.GetPointer();
+		}
+
+		// returns the pointer after the batch
+		TPointer RunBatch(const Batch& batch, Memory<TRegister, TPointer>& memory, TPointer pointer) {
+			size_t count = batch.last - batch.first;
+			std::vector<TPointer> entry(count), exit(count);
+			for (size_t k = 0; k < count; k++) {
+				entry[k] = k == 0 ? pointer : entry[k - 1] + segments[batch.first + k - 1].move;
+			}
+
+			// the private tape is copied before any segment starts writing
+			const Segment& last = segments[batch.last - 1];
+			std::unique_ptr<Memory<TRegister, TPointer>> copy;
+			std::unique_ptr<RangeMemory> tracked;
+			Cpu<TRegister, TProgramCounter, TPointer> speculative;
+			std::atomic<bool> othersDone(false);
+			std::thread speculation;
+			if (!last.bounded) {
+				copy.reset(new Memory<TRegister, TPointer>(memory));
+				tracked.reset(new RangeMemory(*copy));
+				speculation = std::thread([&]() {
+					StartSegment(speculative, last, *tracked, entry[count - 1], &othersDone);
+				});
+			}
+
+			std::vector<std::thread> workers;
+			for (size_t k = 1; k < (tracked != nullptr ? count - 1 : count); k++) {
+				workers.emplace_back([&, k]() {
+					RunSegment(segments[batch.first + k], memory, entry[k], exit[k]);
+				});
+			}
+			RunSegment(segments[batch.first], memory, entry[0], exit[0]);
+			for (auto& worker : workers) {
+				worker.join();
+			}
+
+			if (tracked != nullptr) {
+				othersDone.store(true, std::memory_order_relaxed);
+				speculation.join();
+				bool finished = speculative.GetProgramCounter() == last.end;
+				if (finished) {
+					speculative.Flush(*tracked);
+					exit[count - 1] = speculative.GetPointer();
+				}
+				bool conflict = tracked->high - tracked->low + 1 >= static_cast<int64_t>(Memory<TRegister, TPointer>::size);
+				for (size_t k = 0; k + 1 < count; k++) {
+					const Segment& segment = segments[batch.first + k];
+					conflict = conflict || Overlap(tracked->low, tracked->high, static_cast<int64_t>(entry[k]) + segment.low, static_cast<int64_t>(entry[k]) + segment.high);
+				}
+				if (conflict) {
+					reexecuted++;
+					RunSegment(last, memory, entry[count - 1], exit[count - 1]);
+				}
+				else {
+					for (int64_t location = tracked->low; location <= tracked->high; location++) {
+						memory.Write(static_cast<TPointer>(location), copy->Read(static_cast<TPointer>(location)));
+					}
+					if (!finished) {
+						// so far the run only read cells no other segment wrote, the cpu state carries over to the shared tape
+						NoIo io;
+						SegmentMonitor end;
+						end.end = last.end;
+						end.stop = nullptr;
+						speculative.Run(linked, memory, io, end);
+						speculative.Flush(memory);
+						exit[count - 1] = speculative.GetPointer();
+					}
+				}
+			}
+			return exit[count - 1];
+		}
+
+	public:
+		ParallelExecutor(const Program<TRegister, TProgramCounter>& program, unsigned threads = std::max(2u, std::thread::hardware_concurrency()))
+			: linked(program),
+			reexecuted(0) {
+			monitor.batchAt.assign(program.GetSize() + 1, -1);
+			Split(program);
+			Plan(threads);
+		}
+
+		ExecutionResult Run(Cpu<TRegister, TProgramCounter, TPointer>& cpu, Memory<TRegister, TPointer>& memory) {
+			StandardIo io;
+			while (true) {
+				ExecutionResult result = cpu.Run(linked, memory, io, monitor);
+				if (result != ExecutionResult::Interrupted) {
+					return result;
+				}
+				const Batch& batch = batches[monitor.batchAt[cpu.GetProgramCounter()]];
+				cpu.Flush(memory);
+				TPointer pointer = RunBatch(batch, memory, cpu.GetPointer());
+				cpu.Resume(memory, batch.end, pointer);
+			}
+		}
+
+		const std::vector<Segment>& GetSegments() const {
+			return segments;
+		}
+
+		const std::vector<Batch>& GetBatches() const {
+			return batches;
+		}
+
+		// speculative segments that touched cells of an earlier segment and had to run again
+		size_t GetReexecutedCount() const {
+			return reexecuted;
+		}
+	};
+
+}
@@ -0,0 +1,318 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include "sikfck.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define SIKFCK_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define SIKFCK_RDTSC
+#endif
+
+namespace sikfck {
+
+	// Monitor measuring where Cpu::Run spends its time.
+	// Every samplePeriod-th instruction the counters are read before and after its handler and the difference,
+	// minus the cost of reading, is attributed to its InstructionType. Totals are read in Start and Stop.
+	// Uses a perf_event_open group (cycles, instructions, branch misses, cache misses) on Linux,
+	// when that is not permitted, as in many containers, only time is measured with rdtsc or the steady clock.
+	class Profiler {
+	public:
+		enum Counter { Cycles, Instructions, BranchMisses, CacheMisses, counterCount };
+		enum class Source { PerfEvents, TimeStampCounter, SteadyClock };
+
+	private:
+		static const unsigned typeCount = static_cast<unsigned>(InstructionType::Data) + 1;
+
+		struct Sample {
+			uint64_t value[counterCount];
+		};
+
+		Source source;
+		bool available[counterCount];
+		int descriptors[counterCount]; // perf event file descriptors, the first one leads the group
+		unsigned samplePeriod;
+		unsigned countdown;
+		bool pending;
+		InstructionType pendingType;
+		Sample pendingStart;
+		Sample overhead;
+		Sample begin;
+		Sample total;
+		uint64_t executed[typeCount];
+		uint64_t samples[typeCount];
+		Sample sampled[typeCount];
+
+		void Read(Sample& sample) const {
+			for (unsigned c = 0; c < counterCount; c++) {
+				sample.value[c] = 0;
+			}
+#ifdef __linux__
+			if (source == Source::PerfEvents) {
+				// PERF_FORMAT_GROUP: number of events followed by their values in the order they joined the group
+				uint64_t buffer[1 + counterCount];
+				if (read(descriptors[0], buffer, sizeof(buffer)) > 0) {
+					unsigned index = 1;
+					for (unsigned c = 0; c < counterCount; c++) {
+						if (available[c]) {
+							sample.value[c] = buffer[index++];
+						}
+					}
+				}
+				return;
+			}
+#endif
+#ifdef SIKFCK_RDTSC
+			sample.value[Cycles] = __rdtsc();
+#else
+			sample.value[Cycles] = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+		}
+
+		static void Subtract(Sample& result, const Sample& end, const Sample& start, const Sample& bias) {
+			for (unsigned c = 0; c < counterCount; c++) {
+				uint64_t difference = end.value[c] - start.value[c];
+				result.value[c] = difference > bias.value[c] ? difference - bias.value[c] : 0;
+			}
+		}
+
+		void OpenCounters() {
+#ifdef __linux__
+			static const uint64_t configs[counterCount] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES };
+			for (unsigned c = 0; c < counterCount; c++) {
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = PERF_TYPE_HARDWARE;
+				attr.config = configs[c];
+				attr.disabled = c == 0 ? 1 : 0;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_GROUP;
+				descriptors[c] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, c == 0 ? -1 : descriptors[0], 0));
+				available[c] = descriptors[c] >= 0;
+				if (c == 0 && !available[c]) {
+					// no counters, keep measuring time
+					available[c] = true;
+					return;
+				}
+			}
+			source = Source::PerfEvents;
+#endif
+		}
+
+		void CloseCounters() {
+#ifdef __linux__
+			for (unsigned c = 0; c < counterCount; c++) {
+				if (descriptors[c] >= 0) {
+					close(descriptors[c]);
+					descriptors[c] = -1;
+				}
+			}
+#endif
+		}
+
+	public:
+		// a prime period keeps sampling from locking onto loops of the same length
+		explicit Profiler(unsigned samplePeriod = 1009)
+			: samplePeriod(samplePeriod) {
+#ifdef SIKFCK_RDTSC
+			source = Source::TimeStampCounter;
+#else
+			source = Source::SteadyClock;
+#endif
+			for (unsigned c = 0; c < counterCount; c++) {
+				available[c] = c == Cycles;
+				descriptors[c] = -1;
+			}
+			OpenCounters();
+			Reset();
+		}
+
+		Profiler(const Profiler&) = delete;
+		Profiler& operator=(const Profiler&) = delete;
+
+		~Profiler() {
+			CloseCounters();
+		}
+
+		void Reset() {
+			countdown = samplePeriod;
+			pending = false;
+			for (unsigned t = 0; t < typeCount; t++) {
+				executed[t] = 0;
+				samples[t] = 0;
+				sampled[t] = Sample();
+			}
+			total = Sample();
+		}
+
+		// starts counting and calibrates the cost of a counter read, call before Cpu::Run
+		void Start() {
+#ifdef __linux__
+			if (source == Source::PerfEvents) {
+				ioctl(descriptors[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+				ioctl(descriptors[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+			}
+#endif
+			Sample zero = Sample();
+			for (int i = 0; i < 16; i++) {
+				Sample first, second, difference;
+				Read(first);
+				Read(second);
+				Subtract(difference, second, first, zero);
+				for (unsigned c = 0; c < counterCount; c++) {
+					overhead.value[c] = i == 0 ? difference.value[c] : std::min(overhead.value[c], difference.value[c]);
+				}
+			}
+			Read(begin);
+		}
+
+		// adds the counts since Start to the totals, a sample still open when execution stopped is dropped
+		void Stop() {
+			Sample end, difference;
+			Read(end);
+			Subtract(difference, end, begin, Sample());
+			for (unsigned c = 0; c < counterCount; c++) {
+				total.value[c] += difference.value[c];
+			}
+			pending = false;
+#ifdef __linux__
+			if (source == Source::PerfEvents) {
+				ioctl(descriptors[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+			}
+#endif
+		}
+
+		template <typename TProgramCounter> bool Step(TProgramCounter, InstructionType type) {
+			if (pending) {
+				Sample end, difference;
+				Read(end);
+				Subtract(difference, end, pendingStart, overhead);
+				unsigned index = static_cast<unsigned>(pendingType);
+				for (unsigned c = 0; c < counterCount; c++) {
+					sampled[index].value[c] += difference.value[c];
+				}
+				samples[index]++;
+				pending = false;
+			}
+			executed[static_cast<unsigned>(type)]++;
+			if (--countdown == 0) {
+				countdown = samplePeriod;
+				pending = true;
+				pendingType = type;
+				Read(pendingStart);
+			}
+			return true;
+		}
+
+		Source GetSource() const {
+			return source;
+		}
+
+		bool IsAvailable(Counter counter) const {
+			return available[counter];
+		}
+
+		uint64_t GetTotal(Counter counter) const {
+			return total.value[counter];
+		}
+
+		uint64_t GetExecuted(InstructionType type) const {
+			return executed[static_cast<unsigned>(type)];
+		}
+
+		// Per type table of counts per executed instruction, extrapolated from the samples.
+		// Instructions that only touch the current value and jumps mostly cost dispatch,
+		// pointer moves and the block instructions work on the tape, In and Out do I/O.
+		void Print(std::ostream& out) const {
+			static const char* names[counterCount] = { "cycles", "instr", "br-miss", "cache-miss" };
+			std::ios_base::fmtflags flags = out.flags();
+			std::streamsize precision = out.precision();
+			const char* unit = source == Source::PerfEvents ? "hardware counters" : source == Source::TimeStampCounter ? "rdtsc ticks as cycles" : "steady clock nanoseconds as cycles";
+			out << "\n======= Profile (" << unit << ", every " << samplePeriod << "th instruction sampled) =======\n\n";
+			out << std::left << std::setw(10) << "type" << std::right << std::setw(14) << "executed" << std::setw(10) << "samples";
+			for (unsigned c = 0; c < counterCount; c++) {
+				if (available[c]) {
+					out << std::setw(12) << names[c];
+				}
+			}
+			out << "\n";
+
+			double estimated[3] = { 0, 0, 0 }; // dispatch, memory, io
+			out << std::fixed << std::setprecision(2);
+			for (unsigned t = 0; t < typeCount; t++) {
+				if (executed[t] == 0) {
+					continue;
+				}
+				InstructionType type = static_cast<InstructionType>(t);
+				out << std::left << std::setw(10) << type << std::right << std::setw(14) << executed[t] << std::setw(10) << samples[t];
+				for (unsigned c = 0; c < counterCount; c++) {
+					if (available[c]) {
+						if (samples[t] > 0) {
+							out << std::setw(12) << static_cast<double>(sampled[t].value[c]) / samples[t];
+						}
+						else {
+							out << std::setw(12) << "-";
+						}
+					}
+				}
+				out << "\n";
+				if (samples[t] > 0) {
+					double cycles = static_cast<double>(sampled[t].value[Cycles]) / samples[t] * executed[t];
+					switch (type) {
+					case InstructionType::In:
+					case InstructionType::Out:
+						estimated[2] += cycles;
+						break;
+					case InstructionType::Nop:
+					case InstructionType::Add:
+					case InstructionType::Set:
+					case InstructionType::Jz:
+					case InstructionType::Jnz:
+					case InstructionType::RegSelect:
+						estimated[0] += cycles;
+						break;
+					default:
+						estimated[1] += cycles;
+						break;
+					}
+				}
+			}
+
+			out << "\nTotal";
+			for (unsigned c = 0; c < counterCount; c++) {
+				if (available[c]) {
+					out << "  " << names[c] << ": " << total.value[c];
+				}
+			}
+			if (available[Instructions] && total.value[Cycles] > 0) {
+				out << "  IPC: " << static_cast<double>(total.value[Instructions]) / total.value[Cycles];
+			}
+			out << "\n";
+
+			double sum = estimated[0] + estimated[1] + estimated[2];
+			if (sum > 0) {
+				static const char* categories[3] = { "dispatch", "memory", "io" };
+				int bottleneck = static_cast<int>(std::max_element(estimated, estimated + 3) - estimated);
+				out << "Estimated share: dispatch " << 100 * estimated[0] / sum << "%  memory " << 100 * estimated[1] / sum << "%  io " << 100 * estimated[2] / sum << "%\n";
+				out << "Bottleneck: " << categories[bottleneck] << "\n";
+			}
+			out.flags(flags);
+			out.precision(precision);
+		}
+	};
+
+}
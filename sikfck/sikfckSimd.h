@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIKFCK_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace sikfck {
+
+	// Kernels operating on contiguous cell ranges, with SSE2 versions for int cells.
+	namespace Simd {
+
+		template <typename T> void Add(T* target, const T* delta, size_t count)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				target[i] += delta[i];
+			}
+		}
+
+		// target = (target & keep) + delta, a zero keep mask turns the addition into a set
+		template <typename T> void MaskedAdd(T* target, const T* keep, const T* delta, size_t count)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				target[i] = (target[i] & keep[i]) + delta[i];
+			}
+		}
+
+#ifdef SIKFCK_SSE2
+		inline void Add(int* target, const int* delta, size_t count)
+		{
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target + i));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(delta + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_add_epi32(t, d));
+			}
+			for (; i < count; i++)
+			{
+				target[i] += delta[i];
+			}
+		}
+
+		inline void MaskedAdd(int* target, const int* keep, const int* delta, size_t count)
+		{
+			size_t i = 0;
+			for (; i + 4 <= count; i += 4)
+			{
+				__m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(target + i));
+				__m128i k = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keep + i));
+				__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(delta + i));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_add_epi32(_mm_and_si128(t, k), d));
+			}
+			for (; i < count; i++)
+			{
+				target[i] = (target[i] & keep[i]) + delta[i];
+			}
+		}
+#endif
+
+	}
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <cstddef>
+#include <stdexcept>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Compile time path for programs that are fixed in the host program.
+	// Compile turns a string literal into an instruction array in a constant expression,
+	// Run expands it into straight-line C++ with loops as real loops, so the host compiler
+	// optimizes the program like hand written code. Requires C++14 constexpr support.
+	//
+	//     struct Hello { static constexpr auto code = sikfck::Static::Compile("++++++++[>++++..."); };
+	//     sikfck::Static::Run<Hello>(memory, io);
+	namespace Static {
+
+		struct Op {
+			InstructionType type = InstructionType::Nop;
+			int value = 0;
+		};
+
+		template <size_t N> struct Code {
+			Op ops[N];
+			size_t size;
+
+			// a top level instruction index inside (begin, end) close to the middle, end if the range is a single instruction or loop
+			constexpr size_t Split(size_t begin, size_t end) const {
+				size_t middle = begin + (end - begin) / 2;
+				size_t boundary = end;
+				int depth = 0;
+				for (size_t i = begin; i < end; i++) {
+					if (depth == 0 && i > begin) {
+						boundary = i;
+						if (i >= middle) {
+							return i;
+						}
+					}
+					if (ops[i].type == InstructionType::Jz) {
+						depth++;
+					}
+					else if (ops[i].type == InstructionType::Jnz) {
+						depth--;
+					}
+				}
+				return boundary;
+			}
+		};
+
+		// collapses consecutive instructions and resolves jumps the same way as Compiler::Compile
+		template <size_t N> constexpr Code<N> Compile(const char(&source)[N]) {
+			Code<N> code{};
+			size_t loopStack[N] = {};
+			size_t depth = 0;
+			size_t size = 0;
+			for (size_t i = 0; i < N && source[i] != 0; i++) {
+				InstructionType type = InstructionType::Nop;
+				int value = 0;
+				switch (source[i]) {
+				case '+': type = InstructionType::Add; value = +1; break;
+				case '-': type = InstructionType::Add; value = -1; break;
+				case '>': type = InstructionType::PtrAdd; value = +1; break;
+				case '<': type = InstructionType::PtrAdd; value = -1; break;
+				case '.': type = InstructionType::Out; value = +1; break;
+				case ',': type = InstructionType::In; value = +1; break;
+				case '[': type = InstructionType::Jz; break;
+				case ']': type = InstructionType::Jnz; break;
+				default: continue;
+				}
+				if (type == InstructionType::Jz) {
+					loopStack[depth++] = size;
+					code.ops[size].type = type;
+					size++;
+				}
+				else if (type == InstructionType::Jnz) {
+					if (depth == 0) {
+						throw std::invalid_argument("Unexpected ] found while parsing. Make sure there are no unbalanced brackets.");
+					}
+					size_t matchingIndex = loopStack[--depth];
+					code.ops[matchingIndex].value = static_cast<int>(size - matchingIndex);
+					code.ops[size].type = type;
+					code.ops[size].value = static_cast<int>(matchingIndex) - static_cast<int>(size);
+					size++;
+				}
+				else if (size > 0 && code.ops[size - 1].type == type) {
+					code.ops[size - 1].value += value;
+				}
+				else {
+					code.ops[size].type = type;
+					code.ops[size].value = value;
+					size++;
+				}
+			}
+			if (depth != 0) {
+				throw std::invalid_argument("Reached the end of the code with one or more missing brackets. Make sure there are no unbalanced brackets.");
+			}
+			code.size = size;
+			return code;
+		}
+
+		template <typename TRegister, typename TIo> struct State {
+			Memory<TRegister, unsigned>& memory;
+			TIo& io;
+			unsigned pointer;
+		};
+
+		template <typename TProgram, size_t Index, InstructionType Type> struct Item;
+
+		// instructions [Begin, End) are split at top level boundaries, which keeps template recursion logarithmic
+		template <typename TProgram, size_t Begin, size_t End, bool Single = (TProgram::code.Split(Begin, End) == End)> struct Sequence;
+
+		template <typename TProgram, size_t Begin, size_t End> struct Sequence<TProgram, Begin, End, false> {
+			static const size_t middle = TProgram::code.Split(Begin, End);
+
+			template <typename TState> static void Run(TState& state) {
+				Sequence<TProgram, Begin, middle>::Run(state);
+				Sequence<TProgram, middle, End>::Run(state);
+			}
+		};
+
+		template <typename TProgram, size_t Begin, size_t End> struct Sequence<TProgram, Begin, End, true> {
+			template <typename TState> static void Run(TState& state) {
+				Item<TProgram, Begin, TProgram::code.ops[Begin].type>::Run(state);
+			}
+		};
+
+		template <typename TProgram, size_t Index> struct Sequence<TProgram, Index, Index, true> {
+			template <typename TState> static void Run(TState& state) {}
+		};
+
+		template <typename TProgram, size_t Index> struct Item<TProgram, Index, InstructionType::Add> {
+			template <typename TState> static void Run(TState& state) {
+				state.memory.Write(state.pointer, state.memory.Read(state.pointer) + TProgram::code.ops[Index].value);
+			}
+		};
+
+		template <typename TProgram, size_t Index> struct Item<TProgram, Index, InstructionType::PtrAdd> {
+			template <typename TState> static void Run(TState& state) {
+				state.pointer += TProgram::code.ops[Index].value;
+			}
+		};
+
+		template <typename TProgram, size_t Index> struct Item<TProgram, Index, InstructionType::In> {
+			template <typename TState> static void Run(TState& state) {
+				for (int i = 0; i < TProgram::code.ops[Index].value; i++) {
+					state.memory.Write(state.pointer, state.io.Read());
+				}
+			}
+		};
+
+		template <typename TProgram, size_t Index> struct Item<TProgram, Index, InstructionType::Out> {
+			template <typename TState> static void Run(TState& state) {
+				for (int i = 0; i < TProgram::code.ops[Index].value; i++) {
+					state.io.Write(state.memory.Read(state.pointer));
+				}
+			}
+		};
+
+		template <typename TProgram, size_t Index> struct Item<TProgram, Index, InstructionType::Jz> {
+			static const size_t loopEnd = Index + TProgram::code.ops[Index].value;
+
+			template <typename TState> static void Run(TState& state) {
+				while (state.memory.Read(state.pointer) != 0) {
+					Sequence<TProgram, Index + 1, loopEnd>::Run(state);
+				}
+			}
+		};
+
+		// TProgram provides the compiled code as static constexpr member named code
+		template <typename TProgram, typename TRegister, typename TIo> void Run(Memory<TRegister, unsigned>& memory, TIo& io) {
+			State<TRegister, TIo> state{ memory, io, 0 };
+			Sequence<TProgram, 0, TProgram::code.size>::Run(state);
+		}
+
+		template <typename TProgram, typename TRegister> void Run(Memory<TRegister, unsigned>& memory) {
+			StandardIo io;
+			Run<TProgram>(memory, io);
+		}
+	}
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+#include "sikfck.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace sikfck {
+
+	// Read only snapshot of a memory tape that new Memory instances can be created from.
+	// On Linux the snapshot lives in a memfd and instances map it copy-on-write,
+	// so creating an instance costs the same regardless of how much of the tape is used.
+	// Elsewhere instances copy the snapshot.
+	template <typename TRegister, typename TPointer> class MemoryImage {
+		static const size_t bytes = Memory<TRegister, TPointer>::size * sizeof(TRegister);
+
+#ifdef __linux__
+		int fd;
+
+		static void Unmap(TRegister* storage) {
+			munmap(storage, bytes);
+		}
+#else
+		std::vector<TRegister> cells;
+#endif
+
+	public:
+		explicit MemoryImage(const Memory<TRegister, TPointer>& memory) {
+#ifdef __linux__
+			fd = memfd_create("sikfck-tape", MFD_CLOEXEC);
+			if (fd < 0) {
+				throw std::runtime_error("Failed to create memory image.");
+			}
+			const char* data = reinterpret_cast<const char*>(memory.Data());
+			size_t written = 0;
+			while (written < bytes) {
+				auto result = write(fd, data + written, bytes - written);
+				if (result <= 0) {
+					close(fd);
+					throw std::runtime_error("Failed to write memory image.");
+				}
+				written += static_cast<size_t>(result);
+			}
+#else
+			cells.assign(memory.Data(), memory.Data() + Memory<TRegister, TPointer>::size);
+#endif
+		}
+
+		MemoryImage(const MemoryImage&) = delete;
+		MemoryImage& operator=(const MemoryImage&) = delete;
+
+		~MemoryImage() {
+#ifdef __linux__
+			close(fd);
+#endif
+		}
+
+		Memory<TRegister, TPointer> Instantiate() const {
+#ifdef __linux__
+			void* storage = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (storage == MAP_FAILED) {
+				throw std::runtime_error("Failed to map memory image.");
+			}
+			return Memory<TRegister, TPointer>(static_cast<TRegister*>(storage), Unmap);
+#else
+			Memory<TRegister, TPointer> memory;
+			for (unsigned i = 0; i < Memory<TRegister, TPointer>::size; i++) {
+				memory.Write(i, cells[i]);
+			}
+			return memory;
+#endif
+		}
+	};
+
+	// Stops before the first input or output, or after the given number of instructions.
+	class WarmupMonitor {
+		size_t remaining;
+	public:
+		explicit WarmupMonitor(size_t instructionLimit)
+			: remaining(instructionLimit) {}
+
+		template <typename TProgramCounter> bool Step(TProgramCounter programCounter, InstructionType type) {
+			if (type == InstructionType::In || type == InstructionType::Out) {
+				return false;
+			}
+			if (remaining == 0) {
+				return false;
+			}
+			--remaining;
+			return true;
+		}
+	};
+
+	// A program executed up to a marker point, new instances continue from that point.
+	// The warmup stops before the first I/O so that the template itself has no side effects.
+	template <typename TRegister, typename TProgramCounter, typename TPointer> class VmTemplate {
+		Cpu<TRegister, TProgramCounter, TPointer> cpu;
+		bool halted;
+		MemoryImage<TRegister, TPointer> image;
+
+		static Memory<TRegister, TPointer> Warmup(const Program<TRegister, TProgramCounter>& program, Cpu<TRegister, TProgramCounter, TPointer>& cpu, bool& halted, size_t instructionLimit) {
+			Memory<TRegister, TPointer> memory;
+			WarmupMonitor monitor(instructionLimit);
+			halted = cpu.Run(program, memory, monitor) == ExecutionResult::Halted;
+			return memory;
+		}
+
+	public:
+		VmTemplate(const Program<TRegister, TProgramCounter>& program, size_t instructionLimit = std::numeric_limits<size_t>::max())
+			: cpu(),
+			halted(false),
+			image(Warmup(program, cpu, halted, instructionLimit)) {}
+
+		// true if the program completed during warmup
+		bool IsHalted() const {
+			return halted;
+		}
+
+		Cpu<TRegister, TProgramCounter, TPointer> SpawnCpu() const {
+			return cpu;
+		}
+
+		Memory<TRegister, TPointer> SpawnMemory() const {
+			return image.Instantiate();
+		}
+	};
+
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "sikfck.h"
+#include "sikfckCompiler.h"
+
+namespace sikfck {
+
+	// Runs a cheaply optimized program and counts loop iterations at each Jnz.
+	// When a loop crosses the threshold it is re-optimized with Compiler::OptimizeHotLoop
+	// and patched into the running program in place. The loop is only entered through its Jz,
+	// so once execution is moved back to the Jz the patched code can take over.
+	// If the optimized loop is larger than the original it is left as is.
+	template <typename TRegister, typename TProgramCounter, typename TPointer> class TieredExecutor {
+
+		class HotLoopMonitor {
+		public:
+			std::vector<uint32_t> iterations;
+			uint32_t threshold;
+			TProgramCounter hotLoop;
+
+			bool Step(TProgramCounter programCounter, InstructionType type) {
+				// counters parked at the threshold stop counting, so they cannot wrap around and promote again
+				if (type == InstructionType::Jnz && iterations[programCounter] < threshold && ++iterations[programCounter] == threshold) {
+					hotLoop = programCounter;
+					return false;
+				}
+				return true;
+			}
+		};
+
+		Compiler<TRegister, TProgramCounter>& hotCompiler;
+		Program<TRegister, TProgramCounter> program;
+		LinkedProgram<TRegister, TProgramCounter> linked;
+		HotLoopMonitor monitor;
+		size_t promotedLoops;
+
+		// returns the index of the loop's Jz
+		TProgramCounter Promote(TProgramCounter loopEnd) {
+			TProgramCounter begin = loopEnd + program.ivalue[loopEnd];
+			TProgramCounter end = loopEnd + 1;
+			// registers are live inside a loop promoted by LoopOptimizations::RegisterPromotion and calls jump to
+			// shared code outside the loop, such loops must stay as they are
+			bool usesRegisters = false;
+			for (TProgramCounter i = begin; i < end; ++i) {
+				usesRegisters = usesRegisters || program.itype[i] == InstructionType::RegSelect || program.itype[i] == InstructionType::Call;
+			}
+			Program<TRegister, TProgramCounter> optimized;
+			if (!usesRegisters) {
+				optimized = hotCompiler.OptimizeHotLoop(program, begin, end);
+			}
+			if (!usesRegisters && optimized.GetSize() <= end - begin) {
+				TProgramCounter i = begin;
+				for (TProgramCounter j = 0; j < optimized.GetSize(); ++i, ++j) {
+					program.Replace(i, optimized.ReadDebug(j));
+				}
+				for (; i < end; ++i) {
+					program.Replace(i, Instruction<TRegister>(InstructionType::Nop, 0));
+				}
+				linked.Link(program, begin, end);
+				promotedLoops++;
+			}
+			// loops of this region are done, their counters must not reach the threshold again
+			for (TProgramCounter i = begin; i < end; ++i) {
+				monitor.iterations[i] = monitor.threshold;
+			}
+			return begin;
+		}
+
+	public:
+		TieredExecutor(Compiler<TRegister, TProgramCounter>& hotCompiler, const Program<TRegister, TProgramCounter>& program, uint32_t threshold = 10000)
+			: hotCompiler(hotCompiler),
+			program(program),
+			linked(program),
+			promotedLoops(0) {
+			monitor.iterations.assign(program.GetSize(), 0);
+			monitor.threshold = threshold;
+		}
+
+		ExecutionResult Run(Cpu<TRegister, TProgramCounter, TPointer>& cpu, Memory<TRegister, TPointer>& memory) {
+			while (true) {
+				ExecutionResult result = cpu.Run(linked, memory, monitor);
+				if (result != ExecutionResult::Interrupted) {
+					return result;
+				}
+				// interrupted before the Jnz of a hot loop, resume at its Jz which behaves the same way
+				cpu.SetProgramCounter(Promote(monitor.hotLoop));
+			}
+		}
+
+		// the program with all hot loops patched in so far
+		const Program<TRegister, TProgramCounter>& GetProgram() const {
+			return program;
+		}
+
+		size_t GetPromotedLoopCount() const {
+			return promotedLoops;
+		}
+	};
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "sikfck.h"
+
+namespace sikfck {
+
+	// Wraps a Memory and records every tape access made through it, pass it to Cpu::Run in place of the memory.
+	// Keeps read and write counts per cell, the lowest and highest location accessed, whether the wrap around
+	// the end of the tape was used, and the number of distinct cache lines touched in each window of accesses.
+	// Optionally writes the access stream as a binary trace: "SKTR", then varints for the format version and
+	// the cell size, then one varint per access holding the zigzag encoded distance to the previous access
+	// shifted left by one, with the low bit set for writes.
+	template <typename TRegister, typename TPointer> class TracingMemory {
+	public:
+		static const uint32_t version = 1;
+		static const unsigned lineSize = 64;
+		static const unsigned cellsPerLine = sizeof(TRegister) < lineSize ? lineSize / sizeof(TRegister) : 1;
+		static const unsigned lineCount = Memory<TRegister, TPointer>::size / cellsPerLine;
+
+	private:
+		Memory<TRegister, TPointer>& memory;
+		std::ostream* trace;
+		std::vector<uint64_t> reads;
+		std::vector<uint64_t> writes;
+		int64_t lowest;
+		int64_t highest;
+		int64_t previous;
+		bool wrapped;
+		uint64_t accesses;
+		uint64_t windowSize;
+		uint32_t window;
+		uint32_t windowLines;
+		std::vector<uint32_t> lineWindow; // last window + 1 in which the line was touched, 0 if never
+		std::vector<uint32_t> workingSet; // distinct lines touched in each completed window
+
+		void WriteVarint(uint64_t value) {
+			while (value >= 0x80) {
+				trace->put(static_cast<char>((value & 0x7f) | 0x80));
+				value >>= 7;
+			}
+			trace->put(static_cast<char>(value));
+		}
+
+		void Record(TPointer pointer, bool write) {
+			int64_t location = static_cast<int64_t>(pointer);
+			if (accesses == 0) {
+				lowest = location;
+				highest = location;
+			}
+			lowest = std::min(lowest, location);
+			highest = std::max(highest, location);
+			unsigned cell = pointer & 0xffff;
+			if (static_cast<int64_t>(cell) != location) {
+				wrapped = true;
+			}
+			(write ? writes : reads)[cell]++;
+
+			unsigned line = cell / cellsPerLine;
+			if (lineWindow[line] != window + 1) {
+				lineWindow[line] = window + 1;
+				windowLines++;
+			}
+			if (++accesses % windowSize == 0) {
+				workingSet.push_back(windowLines);
+				windowLines = 0;
+				window++;
+			}
+
+			if (trace != nullptr) {
+				int64_t distance = location - previous;
+				uint64_t zigzag = (static_cast<uint64_t>(distance) << 1) ^ static_cast<uint64_t>(distance >> 63);
+				WriteVarint((zigzag << 1) | (write ? 1 : 0));
+				previous = location;
+			}
+		}
+
+		// the cells visited by a scan from location up to the zero cell at end
+		void RecordScan(TPointer location, TPointer end, TPointer stride, const TRegister* targets, unsigned count) {
+			for (; location != end; location += stride) {
+				Record(location, false);
+				for (unsigned i = 0; i < count; i++) {
+					Record(location + targets[2 * i], false);
+					Record(location + targets[2 * i], true);
+				}
+				Record(location, true);
+			}
+			Record(end, false);
+		}
+
+	public:
+		explicit TracingMemory(Memory<TRegister, TPointer>& memory, std::ostream* trace = nullptr, uint64_t windowSize = 1 << 16)
+			: memory(memory),
+			trace(trace),
+			reads(Memory<TRegister, TPointer>::size),
+			writes(Memory<TRegister, TPointer>::size),
+			lowest(0),
+			highest(0),
+			previous(0),
+			wrapped(false),
+			accesses(0),
+			windowSize(windowSize),
+			window(0),
+			windowLines(0),
+			lineWindow(lineCount) {
+			if (trace != nullptr) {
+				trace->write("SKTR", 4);
+				WriteVarint(version);
+				WriteVarint(sizeof(TRegister));
+			}
+		}
+
+		void Write(TPointer pointer, TRegister value) {
+			Record(pointer, true);
+			memory.Write(pointer, value);
+		}
+
+		TRegister Read(TPointer pointer) {
+			Record(pointer, false);
+			return memory.Read(pointer);
+		}
+
+		void AddBlock(TPointer location, const TRegister* delta, const TRegister* keep, unsigned width) {
+			for (unsigned i = 0; i < width; i++) {
+				Record(location + i, false);
+				Record(location + i, true);
+			}
+			memory.AddBlock(location, delta, keep, width);
+		}
+
+		void Clear(TPointer location, unsigned width) {
+			for (unsigned i = 0; i < width; i++) {
+				Record(location + i, true);
+			}
+			memory.Clear(location, width);
+		}
+
+		TPointer ClearUntilZero(TPointer location, TPointer stride) {
+			TPointer end = memory.ClearUntilZero(location, stride);
+			RecordScan(location, end, stride, nullptr, 0);
+			return end;
+		}
+
+		TPointer MoveUntilZero(TPointer location, TPointer stride, const TRegister* targets, unsigned count) {
+			TPointer end = memory.MoveUntilZero(location, stride, targets, count);
+			RecordScan(location, end, stride, targets, count);
+			return end;
+		}
+
+		uint64_t GetReads(unsigned cell) const {
+			return reads[cell];
+		}
+
+		uint64_t GetWrites(unsigned cell) const {
+			return writes[cell];
+		}
+
+		uint64_t GetAccessCount() const {
+			return accesses;
+		}
+
+		int64_t GetLowest() const {
+			return lowest;
+		}
+
+		int64_t GetHighest() const {
+			return highest;
+		}
+
+		bool IsWrapUsed() const {
+			return wrapped;
+		}
+
+		// Summary of the recorded accesses: tape span, working set compared to typical L1 (32 KiB) and L2 (1 MiB)
+		// sizes, and the hottest ranges of consecutive touched cache lines.
+		void Print(std::ostream& out) const {
+			uint64_t totalReads = 0, totalWrites = 0;
+			unsigned cells = 0;
+			std::vector<uint64_t> lineAccesses(lineCount);
+			for (unsigned cell = 0; cell < Memory<TRegister, TPointer>::size; cell++) {
+				uint64_t count = reads[cell] + writes[cell];
+				totalReads += reads[cell];
+				totalWrites += writes[cell];
+				cells += count > 0 ? 1 : 0;
+				lineAccesses[cell / cellsPerLine] += count;
+			}
+			unsigned lines = 0;
+			for (unsigned line = 0; line < lineCount; line++) {
+				lines += lineAccesses[line] > 0 ? 1 : 0;
+			}
+
+			out << "\n======= Tape Trace =======\n\n";
+			out << "accesses: " << accesses << " (reads " << totalReads << ", writes " << totalWrites << ")\n";
+			out << "cells touched: " << cells << ", cache lines touched: " << lines << " (" << lines * lineSize / 1024.0 << " KiB)\n";
+			if (accesses == 0) {
+				return;
+			}
+			out << "pointer excursion: lowest " << lowest << ", highest " << highest << ", span " << (highest - lowest + 1) << " cells\n";
+			out << "wrap around the end of the tape: " << (wrapped ? "used" : "not used") << "\n";
+
+			uint32_t peak = windowLines;
+			uint64_t sum = windowLines;
+			for (uint32_t count : workingSet) {
+				peak = std::max(peak, count);
+				sum += count;
+			}
+			size_t windows = workingSet.size() + (windowLines > 0 ? 1 : 0);
+			double peakKiB = peak * lineSize / 1024.0;
+			out << "working set per " << windowSize << " accesses: peak " << peak << " lines (" << peakKiB << " KiB), average "
+				<< static_cast<double>(sum) / windows << " lines over " << windows << " windows\n";
+			out << "working set fits in: " << (peakKiB <= 32 ? "L1" : peakKiB <= 1024 ? "L2" : "neither L1 nor L2") << "\n";
+
+			// ranges of consecutive touched lines, hottest first
+			struct Range {
+				unsigned first;
+				unsigned last;
+				uint64_t accesses;
+			};
+			std::vector<Range> ranges;
+			for (unsigned line = 0; line < lineCount; line++) {
+				if (lineAccesses[line] == 0) {
+					continue;
+				}
+				if (!ranges.empty() && ranges.back().last + 1 == line) {
+					ranges.back().last = line;
+					ranges.back().accesses += lineAccesses[line];
+				}
+				else {
+					ranges.push_back(Range{ line, line, lineAccesses[line] });
+				}
+			}
+			std::sort(ranges.begin(), ranges.end(), [](const Range& a, const Range& b) { return a.accesses > b.accesses; });
+			out << "hot ranges:\n";
+			for (size_t i = 0; i < ranges.size() && i < 8; i++) {
+				out << "\tcells " << ranges[i].first * cellsPerLine << ".." << (ranges[i].last + 1) * cellsPerLine - 1
+					<< "\taccesses " << ranges[i].accesses << " (" << 100.0 * ranges[i].accesses / accesses << "%)\n";
+			}
+		}
+	};
+
+}